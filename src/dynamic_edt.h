@@ -0,0 +1,369 @@
+/* Incremental (dynamic) truncated EDT
+ *
+ * The nodes rebuild their occupancy grid on every map message, but
+ * between 1 Hz map updates only a few thousand voxels actually change.
+ * DynamicEDT keeps the occupancy labels and a capped squared distance
+ * field alive between updates and only recomputes around the voxels
+ * that changed.
+ *
+ * Every voxel that flips is a wavefront seed: a newly occupied voxel
+ * can only lower distances and a newly freed one can only raise them,
+ * and in both cases only within the truncation radius of the seed.
+ * The seeds are binned into blocks of BLOCK^3 voxels, the dirty block
+ * mask is dilated by the truncation reach along each axis, and each
+ * connected group of dirty blocks is recomputed with the batch
+ * truncated EDT on its bounding box plus a halo of one reach. Every
+ * obstacle that can influence a voxel of the box lies inside the halo,
+ * so the recomputed voxels are exactly what a full recompute would
+ * produce; nothing outside the dirty blocks is touched.
+ *
+ * Labels follow the EDT convention: nonzero is free space, zero is an
+ * obstacle. Distances are in the units of the weights (voxels when the
+ * weights are 1) and saturate at the truncation. A z_window >= 0 makes
+ * the field layered (per-slice 2D plus z_window slices either side, see
+ * pyedt::_binary_edt3dsq_layered) instead of 3D.
+ */
+
+#ifndef DYNAMIC_EDT_H
+#define DYNAMIC_EDT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "edt.hpp"
+
+class DynamicEDT {
+public:
+  static const int BLOCK = 8;
+
+  DynamicEDT(
+    const size_t sx, const size_t sy, const size_t sz,
+    const float wx, const float wy, const float wz,
+    const float truncation, const int parallel=1, const int z_window=-1
+  );
+
+  size_t sx() const { return dims[0]; }
+  size_t sy() const { return dims[1]; }
+  size_t sz() const { return dims[2]; }
+  size_t voxels() const { return dims[0] * dims[1] * dims[2]; }
+  float truncation() const { return trunc; }
+  bool initialized() const { return ready; }
+
+  bool same_grid(const size_t x, const size_t y, const size_t z) const {
+    return dims[0] == x && dims[1] == y && dims[2] == z;
+  }
+
+  // Capped squared distance and distance of voxel i.
+  float squared(const size_t i) const { return field[i]; }
+  float distance(const size_t i) const { return std::sqrt(field[i]); }
+  const float* data() const { return field.data(); }
+
+  // Rebuilds the whole field from a label volume.
+  template <typename T>
+  void reset(const T* labels);
+
+  // Diffs a full label volume against the stored one and applies the
+  // differences incrementally. The first call falls back to reset().
+  template <typename T>
+  void assign(const T* labels);
+
+  // assign() for a bit-packed occupancy volume (set bit = obstacle,
+  // see edt::set_packed).
+  void assign_packed(const uint64_t* occupancy);
+
+  // Marks the given linear indices occupied / free and repairs the
+  // field around them. Indices that do not change state are ignored.
+  void update(
+    const std::vector<size_t>& occupied,
+    const std::vector<size_t>& freed
+  );
+
+  // Voxels recomputed (including halos) by the last reset or update.
+  size_t last_work() const { return work; }
+
+private:
+  size_t dims[3];
+  size_t blocks[3];
+  float weights[3];
+  int reach[3];
+  float trunc;
+  int parallel;
+  int z_window;
+  bool ready;
+  size_t work;
+
+  std::vector<uint8_t> labels;
+  std::vector<float> field;
+
+  // Scratch reused across updates.
+  std::vector<size_t> seeds;
+  std::vector<uint8_t> dirty;
+  std::vector<uint8_t> dilated;
+  std::vector<size_t> queue;
+  std::vector<uint8_t> sub_labels;
+  std::vector<float> sub_field;
+
+  void dilate_dirty();
+  void recompute(const size_t lo[3], const size_t hi[3]);
+};
+
+inline DynamicEDT::DynamicEDT(
+    const size_t sx, const size_t sy, const size_t sz,
+    const float wx, const float wy, const float wz,
+    const float truncation, const int parallel, const int z_window
+  ) : trunc(truncation), parallel(parallel), z_window(z_window),
+      ready(false), work(0) {
+
+  dims[0] = sx; dims[1] = sy; dims[2] = sz;
+  weights[0] = wx; weights[1] = wy; weights[2] = wz;
+  for (int a = 0; a < 3; a++) {
+    blocks[a] = (dims[a] + BLOCK - 1) / BLOCK;
+    // A displacement of reach voxels along the axis already reaches the
+    // truncation, so nothing farther away can matter.
+    reach[a] = (weights[a] >= trunc)
+      ? 0
+      : (int)std::ceil(trunc / weights[a]);
+  }
+  if (z_window >= 0) {
+    reach[2] = std::min(reach[2], z_window);
+  }
+
+  labels.assign(voxels(), 1);
+  field.assign(voxels(), trunc * trunc);
+  dirty.assign(blocks[0] * blocks[1] * blocks[2], 0);
+  dilated.assign(dirty.size(), 0);
+}
+
+template <typename T>
+void DynamicEDT::reset(const T* input) {
+  for (size_t i = 0; i < voxels(); i++) {
+    labels[i] = (input[i] != 0);
+  }
+
+  pyedt::_binary_edt3dsq_truncated<uint8_t>(
+    labels.data(), dims[0], dims[1], dims[2],
+    weights[0], weights[1], weights[2],
+    trunc, /*black_border=*/false, parallel, field.data(), z_window
+  );
+
+  ready = true;
+  work = voxels();
+}
+
+template <typename T>
+void DynamicEDT::assign(const T* input) {
+  if (!ready) {
+    reset(input);
+    return;
+  }
+
+  std::vector<size_t> occupied, freed;
+  for (size_t i = 0; i < voxels(); i++) {
+    const uint8_t label = (input[i] != 0);
+    if (label == labels[i]) {
+      continue;
+    }
+    if (label) {
+      freed.push_back(i);
+    }
+    else {
+      occupied.push_back(i);
+    }
+  }
+
+  update(occupied, freed);
+}
+
+inline void DynamicEDT::assign_packed(const uint64_t* occupancy) {
+  const size_t row_words = edt::packed_row_words(dims[0]);
+  const size_t rows = dims[1] * dims[2];
+
+  if (!ready) {
+    for (size_t row = 0; row < rows; row++) {
+      for (size_t x = 0; x < dims[0]; x++) {
+        labels[row * dims[0] + x] = !((occupancy[row * row_words + x / 64] >> (x % 64)) & 1);
+      }
+    }
+    reset(labels.data());
+    return;
+  }
+
+  std::vector<size_t> occupied, freed;
+  for (size_t row = 0; row < rows; row++) {
+    for (size_t x = 0; x < dims[0]; x++) {
+      const size_t i = row * dims[0] + x;
+      const uint8_t label = !((occupancy[row * row_words + x / 64] >> (x % 64)) & 1);
+      if (label == labels[i]) {
+        continue;
+      }
+      if (label) {
+        freed.push_back(i);
+      }
+      else {
+        occupied.push_back(i);
+      }
+    }
+  }
+
+  update(occupied, freed);
+}
+
+inline void DynamicEDT::update(
+    const std::vector<size_t>& occupied,
+    const std::vector<size_t>& freed
+  ) {
+
+  work = 0;
+
+  // Apply the changes; only voxels that flip seed a wavefront.
+  seeds.clear();
+  for (size_t i = 0; i < occupied.size(); i++) {
+    if (labels[occupied[i]]) {
+      labels[occupied[i]] = 0;
+      seeds.push_back(occupied[i]);
+    }
+  }
+  for (size_t i = 0; i < freed.size(); i++) {
+    if (!labels[freed[i]]) {
+      labels[freed[i]] = 1;
+      seeds.push_back(freed[i]);
+    }
+  }
+
+  if (seeds.empty()) {
+    return;
+  }
+
+  if (!ready) {
+    reset(labels.data());
+    return;
+  }
+
+  const size_t sxy = dims[0] * dims[1];
+  const size_t bxy = blocks[0] * blocks[1];
+
+  std::fill(dirty.begin(), dirty.end(), 0);
+  for (size_t i = 0; i < seeds.size(); i++) {
+    const size_t x = seeds[i] % dims[0];
+    const size_t y = (seeds[i] / dims[0]) % dims[1];
+    const size_t z = seeds[i] / sxy;
+    dirty[(x / BLOCK) + blocks[0] * (y / BLOCK) + bxy * (z / BLOCK)] = 1;
+  }
+
+  dilate_dirty();
+
+  // Recompute each 6-connected group of dirty blocks over its bounding
+  // box. dirty doubles as the visited mask.
+  for (size_t b = 0; b < dirty.size(); b++) {
+    if (!dirty[b]) {
+      continue;
+    }
+
+    size_t lo[3] = { blocks[0], blocks[1], blocks[2] };
+    size_t hi[3] = { 0, 0, 0 };
+
+    queue.clear();
+    queue.push_back(b);
+    dirty[b] = 0;
+    while (!queue.empty()) {
+      const size_t cur = queue.back();
+      queue.pop_back();
+
+      const size_t c[3] = {
+        cur % blocks[0], (cur / blocks[0]) % blocks[1], cur / bxy
+      };
+      for (int a = 0; a < 3; a++) {
+        lo[a] = std::min(lo[a], c[a]);
+        hi[a] = std::max(hi[a], c[a]);
+      }
+
+      const size_t step[3] = { 1, blocks[0], bxy };
+      for (int a = 0; a < 3; a++) {
+        if (c[a] > 0 && dirty[cur - step[a]]) {
+          dirty[cur - step[a]] = 0;
+          queue.push_back(cur - step[a]);
+        }
+        if (c[a] + 1 < blocks[a] && dirty[cur + step[a]]) {
+          dirty[cur + step[a]] = 0;
+          queue.push_back(cur + step[a]);
+        }
+      }
+    }
+
+    for (int a = 0; a < 3; a++) {
+      lo[a] = lo[a] * BLOCK;
+      hi[a] = std::min((hi[a] + 1) * BLOCK, dims[a]);
+    }
+    recompute(lo, hi);
+  }
+}
+
+// Grows the dirty block mask by the reach along each axis, one axis at
+// a time.
+inline void DynamicEDT::dilate_dirty() {
+  const size_t step[3] = { 1, blocks[0], blocks[0] * blocks[1] };
+
+  for (int a = 0; a < 3; a++) {
+    const size_t radius = (reach[a] + BLOCK - 1) / BLOCK;
+    if (radius == 0) {
+      continue;
+    }
+
+    std::fill(dilated.begin(), dilated.end(), 0);
+    for (size_t b = 0; b < dirty.size(); b++) {
+      if (!dirty[b]) {
+        continue;
+      }
+      const size_t c = (b / step[a]) % blocks[a];
+      const size_t first = c - std::min(c, radius);
+      const size_t last = std::min(c + radius, blocks[a] - 1);
+      for (size_t k = first; k <= last; k++) {
+        dilated[b + (k - c) * step[a]] = 1;
+      }
+    }
+    dirty.swap(dilated);
+  }
+}
+
+// Recomputes voxels [lo, hi) from the labels of the box grown by a halo
+// of one reach, and writes back only [lo, hi).
+inline void DynamicEDT::recompute(const size_t lo[3], const size_t hi[3]) {
+  size_t hlo[3], hsz[3];
+  for (int a = 0; a < 3; a++) {
+    hlo[a] = lo[a] - std::min(lo[a], (size_t)reach[a]);
+    hsz[a] = std::min(hi[a] + reach[a], dims[a]) - hlo[a];
+  }
+
+  const size_t sub_voxels = hsz[0] * hsz[1] * hsz[2];
+  sub_labels.resize(sub_voxels);
+  sub_field.resize(sub_voxels);
+
+  for (size_t z = 0; z < hsz[2]; z++) {
+    for (size_t y = 0; y < hsz[1]; y++) {
+      const uint8_t* src = labels.data() + hlo[0]
+        + dims[0] * ((hlo[1] + y) + dims[1] * (hlo[2] + z));
+      std::copy(src, src + hsz[0],
+        sub_labels.data() + hsz[0] * (y + hsz[1] * z));
+    }
+  }
+
+  pyedt::_binary_edt3dsq_truncated<uint8_t>(
+    sub_labels.data(), hsz[0], hsz[1], hsz[2],
+    weights[0], weights[1], weights[2],
+    trunc, /*black_border=*/false, parallel, sub_field.data(), z_window
+  );
+
+  for (size_t z = lo[2]; z < hi[2]; z++) {
+    for (size_t y = lo[1]; y < hi[1]; y++) {
+      const float* src = sub_field.data() + (lo[0] - hlo[0])
+        + hsz[0] * ((y - hlo[1]) + hsz[1] * (z - hlo[2]));
+      std::copy(src, src + (hi[0] - lo[0]),
+        field.data() + lo[0] + dims[0] * (y + dims[1] * z));
+    }
+  }
+
+  work += sub_voxels;
+}
+
+#endif
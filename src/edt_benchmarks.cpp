@@ -0,0 +1,418 @@
+/* EDT microbenchmarks
+ *
+ * Times the edt.hpp entry points the nodes depend on (binary_edt and
+ * the multi-label edt, in 2D and 3D) over a sweep of grid sizes,
+ * obstacle densities, anisotropies and thread counts, and reports
+ * throughput and peak resident memory for each configuration.
+ *
+ * Runs standalone, without a ROS master:
+ *
+ *   rosrun ground_finder ground_finder_benchmarks [options]
+ *
+ *   --quick        small grids only (a few seconds in total)
+ *   --reps N       timed repetitions per configuration (default 5)
+ *   --filter STR   only run cases whose name contains STR
+ *   --csv          comma separated output
+ *   --check [N]    compare every entry point against a brute-force
+ *                  reference on N random volumes (default 200, see
+ *                  edt_check.h) instead of benchmarking
+ *   --seed S       random seed of --check
+ *   --record FILE  write the median times to FILE as a baseline
+ *   --baseline FILE
+ *                  compare against a recorded baseline and fail if a
+ *                  configuration got slower than the threshold
+ *   --threshold F  allowed slowdown for --baseline (default 0.25 = 25%)
+ *
+ * Baselines are only comparable on the same machine and build; record
+ * one before an optimisation and check against it after. The exit code
+ * is nonzero if --check finds a mismatch or --baseline a regression.
+ *
+ * Every configuration is run once untimed to warm up the executor
+ * threads and the per-thread scratch, then reps times; the median is
+ * reported. Peak RSS is reset before each configuration where the
+ * kernel allows it (/proc/self/clear_refs), so it reflects that
+ * configuration alone rather than the whole run.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "edt.hpp"
+#include "edt_check.h"
+
+namespace {
+
+struct Options {
+  bool quick = false;
+  bool csv = false;
+  int reps = 5;
+  std::string filter;
+  int check_trials = 0;
+  unsigned seed = 1;
+  std::string record;
+  std::string baseline;
+  double threshold = 0.25;
+};
+
+// Median time in ms of every configuration run, keyed by its table row.
+typedef std::map<std::string, double> Timings;
+
+struct Grid {
+  int sx, sy, sz;
+};
+
+struct Weights {
+  float wx, wy, wz;
+};
+
+// Peak resident set size in kB since the last reset_peak_rss().
+long peak_rss_kb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::atol(line.c_str() + 6);
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void reset_peak_rss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (clear_refs) {
+    clear_refs << "5";
+  }
+}
+
+// Binary labels: nonzero is free space, zero an obstacle.
+std::vector<uint8_t> random_binary(
+    const size_t voxels, const double density, std::mt19937& rng
+  ) {
+
+  std::bernoulli_distribution obstacle(density);
+  std::vector<uint8_t> labels(voxels);
+  for (size_t i = 0; i < voxels; i++) {
+    labels[i] = !obstacle(rng);
+  }
+  return labels;
+}
+
+// Multi-label volume: runs of a few labels along x, with obstacles
+// (label 0) at the given density, so the segment logic of the
+// multi-label path is actually exercised.
+std::vector<uint32_t> random_labels(
+    const size_t voxels, const double density, std::mt19937& rng
+  ) {
+
+  std::bernoulli_distribution obstacle(density);
+  std::uniform_int_distribution<int> run(1, 16);
+  std::uniform_int_distribution<uint32_t> label(1, 8);
+  std::vector<uint32_t> labels(voxels);
+  size_t i = 0;
+  while (i < voxels) {
+    const size_t end = std::min(voxels, i + run(rng));
+    const uint32_t current = label(rng);
+    for (; i < end; i++) {
+      labels[i] = obstacle(rng) ? 0 : current;
+    }
+  }
+  return labels;
+}
+
+// Runs fn once to warm up, then reps times, and returns the median in
+// seconds.
+template <typename F>
+double median_seconds(const int reps, const F& fn) {
+  fn();
+
+  std::vector<double> samples;
+  for (int r = 0; r < reps; r++) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const auto stop = std::chrono::steady_clock::now();
+    samples.push_back(std::chrono::duration<double>(stop - start).count());
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+void print_header(const Options& options) {
+  if (options.csv) {
+    printf("case,sx,sy,sz,density,wx,wy,wz,parallel,ms,mvox_per_s,peak_rss_mb\n");
+  }
+  else {
+    printf("%-16s %16s %7s %14s %3s %10s %10s %10s\n",
+      "case", "grid", "density", "weights", "par", "ms", "Mvox/s", "RSS MB");
+  }
+}
+
+std::string timing_key(
+    const char* name, const Grid& grid, const double density,
+    const Weights& w, const int parallel
+  ) {
+
+  char key[160];
+  snprintf(key, sizeof(key), "%s,%d,%d,%d,%g,%g,%g,%g,%d",
+    name, grid.sx, grid.sy, grid.sz, density, w.wx, w.wy, w.wz, parallel);
+  return key;
+}
+
+void print_row(
+    const Options& options, const char* name, const Grid& grid,
+    const double density, const Weights& w, const int parallel,
+    const double seconds, const long rss_kb
+  ) {
+
+  const double voxels = (double)grid.sx * grid.sy * grid.sz;
+  const double mvox = voxels / seconds / 1e6;
+  const double rss_mb = rss_kb / 1024.0;
+
+  if (options.csv) {
+    printf("%s,%d,%d,%d,%g,%g,%g,%g,%d,%.3f,%.2f,%.1f\n",
+      name, grid.sx, grid.sy, grid.sz, density, w.wx, w.wy, w.wz,
+      parallel, seconds * 1e3, mvox, rss_mb);
+  }
+  else {
+    char dims[48], weights[48];
+    snprintf(dims, sizeof(dims), "%dx%dx%d", grid.sx, grid.sy, grid.sz);
+    snprintf(weights, sizeof(weights), "%gx%gx%g", w.wx, w.wy, w.wz);
+    printf("%-16s %16s %7g %14s %3d %10.3f %10.2f %10.1f\n",
+      name, dims, density, weights, parallel, seconds * 1e3, mvox, rss_mb);
+  }
+  fflush(stdout);
+}
+
+template <typename T, typename F>
+void sweep(
+    const Options& options, Timings& timings, const char* name,
+    const std::vector<Grid>& grids, const std::vector<double>& densities,
+    const std::vector<Weights>& weights, const std::vector<int>& parallels,
+    std::vector<T> (*generate)(const size_t, const double, std::mt19937&),
+    const F& transform
+  ) {
+
+  if (!options.filter.empty() && std::string(name).find(options.filter) == std::string::npos) {
+    return;
+  }
+
+  for (size_t g = 0; g < grids.size(); g++) {
+    const Grid& grid = grids[g];
+    const size_t voxels = (size_t)grid.sx * grid.sy * grid.sz;
+    std::vector<float> output(voxels);
+
+    for (size_t d = 0; d < densities.size(); d++) {
+      std::mt19937 rng(1234 + g * 31 + d);
+      const std::vector<T> labels = generate(voxels, densities[d], rng);
+
+      for (size_t w = 0; w < weights.size(); w++) {
+        for (size_t p = 0; p < parallels.size(); p++) {
+          reset_peak_rss();
+          const double seconds = median_seconds(options.reps, [&]() {
+            transform(labels.data(), grid, weights[w], parallels[p], output.data());
+          });
+          print_row(options, name, grid, densities[d], weights[w],
+            parallels[p], seconds, peak_rss_kb());
+          timings[timing_key(name, grid, densities[d], weights[w], parallels[p])] = seconds * 1e3;
+        }
+      }
+    }
+  }
+}
+
+bool parse_options(const int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--quick")) {
+      options.quick = true;
+    }
+    else if (!strcmp(argv[i], "--csv")) {
+      options.csv = true;
+    }
+    else if (!strcmp(argv[i], "--reps") && i + 1 < argc) {
+      options.reps = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      options.filter = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--check")) {
+      options.check_trials = 200;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.check_trials = std::max(1, atoi(argv[++i]));
+      }
+    }
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      options.seed = (unsigned)strtoul(argv[++i], NULL, 10);
+    }
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      options.record = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+      options.baseline = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+      options.threshold = atof(argv[++i]);
+    }
+    else {
+      fprintf(stderr,
+        "usage: %s [--quick] [--reps N] [--filter STR] [--csv] [--check [N]] [--seed S]\n"
+        "       [--record FILE] [--baseline FILE] [--threshold F]\n", argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool write_timings(const std::string& path, const Timings& timings) {
+  std::ofstream file(path.c_str());
+  if (!file) {
+    fprintf(stderr, "cannot write %s\n", path.c_str());
+    return false;
+  }
+  for (Timings::const_iterator it = timings.begin(); it != timings.end(); ++it) {
+    file << it->first << " " << it->second << "\n";
+  }
+  return true;
+}
+
+bool read_timings(const std::string& path, Timings& timings) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    fprintf(stderr, "cannot read %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    double ms;
+    if (fields >> key >> ms) {
+      timings[key] = ms;
+    }
+  }
+  return true;
+}
+
+// Returns the number of configurations slower than the baseline by more
+// than the threshold. Configurations missing on either side are skipped.
+int compare_timings(const Timings& baseline, const Timings& timings, const double threshold) {
+  int regressions = 0;
+  int compared = 0;
+  for (Timings::const_iterator it = timings.begin(); it != timings.end(); ++it) {
+    Timings::const_iterator base = baseline.find(it->first);
+    if (base == baseline.end()) {
+      continue;
+    }
+    compared++;
+    const double ratio = it->second / base->second;
+    if (ratio > 1.0 + threshold) {
+      regressions++;
+      printf("REGRESSION %s: %.3f ms, baseline %.3f ms (+%.0f%%)\n",
+        it->first.c_str(), it->second, base->second, (ratio - 1.0) * 100.0);
+    }
+  }
+  printf("baseline: %d of %d configurations regressed by more than %.0f%%\n",
+    regressions, compared, threshold * 100.0);
+  return regressions;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    return 1;
+  }
+
+  if (options.check_trials > 0) {
+    return edt_check::run_edt_checks(options.check_trials, options.seed, false) ? 1 : 0;
+  }
+
+  Timings baseline;
+  if (!options.baseline.empty() && !read_timings(options.baseline, baseline)) {
+    return 1;
+  }
+
+  // Grids around the sizes the nodes use: a local bbx of a few meters at
+  // 0.1 m, up to a full map. The 2D grids are one slice of similar size.
+  const std::vector<Grid> grids_3d = options.quick
+    ? std::vector<Grid>{ {64, 64, 32}, {128, 128, 32} }
+    : std::vector<Grid>{ {64, 64, 32}, {128, 128, 64}, {256, 256, 64}, {384, 384, 96} };
+  const std::vector<Grid> grids_2d = options.quick
+    ? std::vector<Grid>{ {256, 256, 1} }
+    : std::vector<Grid>{ {256, 256, 1}, {1024, 1024, 1}, {2048, 2048, 1} };
+
+  const std::vector<double> densities = { 0.01, 0.1, 0.5 };
+
+  // Isotropic voxels, and the coarse z used to approximate a per-slice
+  // transform in the ground extraction.
+  const std::vector<Weights> weights_3d = { {1.0, 1.0, 1.0}, {1.0, 1.0, 4.0} };
+  const std::vector<Weights> weights_2d = { {1.0, 1.0, 1.0}, {1.0, 2.0, 1.0} };
+
+  std::vector<int> parallels = { 1 };
+  const int hardware = (int)std::thread::hardware_concurrency();
+  for (int p = 2; p <= hardware; p *= 2) {
+    parallels.push_back(p);
+  }
+  if (hardware > 1 && parallels.back() != hardware) {
+    parallels.push_back(hardware);
+  }
+
+  print_header(options);
+
+  Timings timings;
+
+  sweep<uint8_t>(options, timings, "binary_edt_3d",
+    grids_3d, densities, weights_3d, parallels, random_binary,
+    [](const uint8_t* labels, const Grid& g, const Weights& w, const int parallel, float* output) {
+      edt::binary_edt<uint8_t>(const_cast<uint8_t*>(labels),
+        g.sx, g.sy, g.sz, w.wx, w.wy, w.wz,
+        /*black_border=*/false, parallel, output);
+    });
+
+  sweep<uint32_t>(options, timings, "edt_3d",
+    grids_3d, densities, weights_3d, parallels, random_labels,
+    [](const uint32_t* labels, const Grid& g, const Weights& w, const int parallel, float* output) {
+      edt::edt<uint32_t>(const_cast<uint32_t*>(labels),
+        g.sx, g.sy, g.sz, w.wx, w.wy, w.wz,
+        /*black_border=*/false, parallel, output);
+    });
+
+  sweep<uint8_t>(options, timings, "binary_edt_2d",
+    grids_2d, densities, weights_2d, parallels, random_binary,
+    [](const uint8_t* labels, const Grid& g, const Weights& w, const int parallel, float* output) {
+      edt::binary_edt<uint8_t>(const_cast<uint8_t*>(labels),
+        g.sx, g.sy, w.wx, w.wy,
+        /*black_border=*/false, parallel, output);
+    });
+
+  sweep<uint32_t>(options, timings, "edt_2d",
+    grids_2d, densities, weights_2d, parallels, random_labels,
+    [](const uint32_t* labels, const Grid& g, const Weights& w, const int parallel, float* output) {
+      edt::edt<uint32_t>(const_cast<uint32_t*>(labels),
+        g.sx, g.sy, w.wx, w.wy,
+        /*black_border=*/false, parallel, output);
+    });
+
+  if (!options.record.empty() && !write_timings(options.record, timings)) {
+    return 1;
+  }
+
+  if (!options.baseline.empty() && compare_timings(baseline, timings, options.threshold) > 0) {
+    return 1;
+  }
+
+  return 0;
+}
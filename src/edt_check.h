@@ -0,0 +1,498 @@
+/* Brute-force reference check of edt.hpp
+ *
+ * Compares the edt.hpp entry points against an O(N^2) reference on
+ * small random volumes: every voxel is measured against every voxel
+ * (and, with black_border, the virtual obstacles just outside the
+ * volume) directly. Volumes are kept tiny and odd-shaped so that edge
+ * cases (single voxel rows, empty and full volumes, label runs touching
+ * the border) come up often.
+ *
+ * The reference follows the edt.hpp conventions:
+ *
+ *   - binary labels: zero is an obstacle, the distance is to the
+ *     nearest zero voxel,
+ *   - multi-label: the distance is to the nearest voxel with a
+ *     different label; voxels labelled 0 are 0,
+ *   - no boundary at all gives INFINITY,
+ *   - with black_border the faces of the volume are boundaries too.
+ *
+ * Squared distances are compared with a relative tolerance, since the
+ * parabolic passes and the reference sum the terms in different orders.
+ *
+ * run_edt_checks() also exercises the thread pool's Latch, for runs under
+ * a sanitizer. It returns the number of mismatching configurations and
+ * prints the first few.
+ */
+
+#ifndef EDT_CHECK_H
+#define EDT_CHECK_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include "edt.hpp"
+#include "sparse_edt.h"
+
+namespace edt_check {
+
+struct Volume {
+  int sx, sy, sz;
+  float wx, wy, wz;
+  std::vector<uint32_t> labels;
+
+  size_t voxels() const {
+    return (size_t)sx * sy * sz;
+  }
+};
+
+// Squared distance from voxel i to the nearest voxel that is a boundary
+// for it, optionally restricted to obstacles within z_window slices.
+inline float reference_sq(
+    const Volume& v, const size_t i, const bool binary,
+    const bool black_border, const int dims, const int z_window=-1
+  ) {
+
+  const int sxy = v.sx * v.sy;
+  const int x = i % v.sx, y = (i / v.sx) % v.sy, z = i / sxy;
+  const uint32_t label = v.labels[i];
+
+  if (label == 0) {
+    return 0.0f;
+  }
+
+  double best = INFINITY;
+  for (size_t j = 0; j < v.voxels(); j++) {
+    const bool boundary = binary ? (v.labels[j] == 0) : (v.labels[j] != label);
+    if (!boundary) {
+      continue;
+    }
+    const int dx = (int)(j % v.sx) - x;
+    const int dy = (int)((j / v.sx) % v.sy) - y;
+    const int dz = (int)(j / sxy) - z;
+    if (z_window >= 0 && std::abs(dz) > z_window) {
+      continue;
+    }
+    best = std::min(best,
+      (double)dx * dx * v.wx * v.wx
+      + (double)dy * dy * v.wy * v.wy
+      + (double)dz * dz * v.wz * v.wz);
+  }
+
+  if (black_border) {
+    const int pos[3] = { x, y, z };
+    const int size[3] = { v.sx, v.sy, v.sz };
+    const float w[3] = { v.wx, v.wy, v.wz };
+    for (int a = 0; a < dims; a++) {
+      const int edge = std::min(pos[a] + 1, size[a] - pos[a]);
+      if (a == 2 && z_window >= 0 && edge > z_window) {
+        continue;
+      }
+      best = std::min(best, (double)edge * edge * w[a] * w[a]);
+    }
+  }
+
+  return (float)best;
+}
+
+inline bool close_sq(const float value, const float expected) {
+  if (std::isinf(expected) || std::isinf(value)) {
+    return std::isinf(expected) && std::isinf(value);
+  }
+  return std::fabs(value - expected) <= 1e-4f * std::max(1.0f, expected);
+}
+
+class Checker {
+public:
+  explicit Checker(const bool verbose) : failures(0), checks(0), verbose(verbose) {}
+
+  // Compares n values (squared if squared, else distances) against the
+  // reference of the given voxels and records one failure per call.
+  template <typename F>
+  void expect(
+      const std::string& name, const Volume& v, const float* values,
+      const size_t n, const bool squared, const F& expected_sq
+    ) {
+
+    checks++;
+    for (size_t q = 0; q < n; q++) {
+      const float expected = expected_sq(q);
+      const float value = squared ? values[q] : values[q] * values[q];
+      if (!close_sq(value, expected)) {
+        failures++;
+        if (verbose || failures <= 10) {
+          printf("FAIL %s %dx%dx%d w=%gx%gx%g at %zu: got %g expected %g\n",
+            name.c_str(), v.sx, v.sy, v.sz, v.wx, v.wy, v.wz,
+            q, values[q],
+            squared ? expected : std::sqrt(expected));
+        }
+        return;
+      }
+    }
+  }
+
+  int failures;
+  int checks;
+
+private:
+  bool verbose;
+};
+
+inline Volume random_volume(std::mt19937& rng, const int dims, const bool binary) {
+  Volume v;
+  std::uniform_int_distribution<int> extent(1, dims == 1 ? 40 : (dims == 2 ? 14 : 9));
+  v.sx = extent(rng);
+  v.sy = (dims >= 2) ? extent(rng) : 1;
+  v.sz = (dims >= 3) ? extent(rng) : 1;
+
+  const float weights[] = { 1.0f, 1.0f, 0.5f, 2.0f, 3.7f };
+  std::uniform_int_distribution<int> weight(0, 4);
+  v.wx = weights[weight(rng)];
+  v.wy = weights[weight(rng)];
+  v.wz = weights[weight(rng)];
+
+  // Density 0 and 1 included, for the empty and full volumes.
+  const double densities[] = { 0.0, 0.02, 0.1, 0.3, 0.7, 1.0 };
+  std::bernoulli_distribution obstacle(densities[rng() % 6]);
+  std::uniform_int_distribution<uint32_t> label(1, binary ? 1 : 3);
+
+  v.labels.resize(v.voxels());
+  uint32_t current = label(rng);
+  for (size_t i = 0; i < v.voxels(); i++) {
+    if (!binary && rng() % 4 == 0) {
+      current = label(rng);
+    }
+    v.labels[i] = obstacle(rng) ? 0 : current;
+  }
+  return v;
+}
+
+inline void check_1d(Checker& check, std::mt19937& rng, const bool black_border) {
+  for (int b = 0; b < 2; b++) {
+    const bool binary = (b == 1);
+    Volume v = random_volume(rng, 1, binary);
+    auto expected = [&](const size_t q) {
+      return reference_sq(v, q, binary, black_border, 1);
+    };
+    const std::string suffix = black_border ? " black_border" : "";
+
+    float* d = binary
+      ? edt::binary_edt<uint32_t>(v.labels.data(), v.sx, v.wx, black_border)
+      : edt::edt<uint32_t>(v.labels.data(), v.sx, v.wx, black_border);
+    check.expect(std::string(binary ? "binary_edt 1d" : "edt 1d") + suffix,
+      v, d, v.voxels(), false, expected);
+    delete [] d;
+
+    d = binary
+      ? edt::binary_edtsq<uint32_t>(v.labels.data(), v.sx, v.wx, black_border)
+      : edt::edtsq<uint32_t>(v.labels.data(), v.sx, v.wx, black_border);
+    check.expect(std::string(binary ? "binary_edtsq 1d" : "edtsq 1d") + suffix,
+      v, d, v.voxels(), true, expected);
+    delete [] d;
+  }
+}
+
+inline void check_2d(
+    Checker& check, std::mt19937& rng, const bool black_border, const int parallel
+  ) {
+
+  for (int b = 0; b < 2; b++) {
+    const bool binary = (b == 1);
+    Volume v = random_volume(rng, 2, binary);
+    auto expected = [&](const size_t q) {
+      return reference_sq(v, q, binary, black_border, 2);
+    };
+    const std::string suffix = black_border ? " black_border" : "";
+
+    float* d = binary
+      ? edt::binary_edt<uint32_t>(v.labels.data(), v.sx, v.sy, v.wx, v.wy, black_border, parallel)
+      : edt::edt<uint32_t>(v.labels.data(), v.sx, v.sy, v.wx, v.wy, black_border, parallel);
+    check.expect(std::string(binary ? "binary_edt 2d" : "edt 2d") + suffix,
+      v, d, v.voxels(), false, expected);
+    delete [] d;
+
+    d = binary
+      ? edt::binary_edtsq<uint32_t>(v.labels.data(), v.sx, v.sy, v.wx, v.wy, black_border, parallel)
+      : edt::edtsq<uint32_t>(v.labels.data(), v.sx, v.sy, v.wx, v.wy, black_border, parallel);
+    check.expect(std::string(binary ? "binary_edtsq 2d" : "edtsq 2d") + suffix,
+      v, d, v.voxels(), true, expected);
+    delete [] d;
+  }
+}
+
+inline void check_3d(
+    Checker& check, std::mt19937& rng, const bool black_border, const int parallel
+  ) {
+
+  const std::string suffix = black_border ? " black_border" : "";
+
+  // Multi-label
+  {
+    Volume v = random_volume(rng, 3, false);
+    auto expected = [&](const size_t q) {
+      return reference_sq(v, q, false, black_border, 3);
+    };
+
+    float* d = edt::edt<uint32_t>(v.labels.data(), v.sx, v.sy, v.sz,
+      v.wx, v.wy, v.wz, black_border, parallel);
+    check.expect("edt 3d" + suffix, v, d, v.voxels(), false, expected);
+    delete [] d;
+
+    d = edt::edtsq<uint32_t>(v.labels.data(), v.sx, v.sy, v.sz,
+      v.wx, v.wy, v.wz, black_border, parallel);
+    check.expect("edtsq 3d" + suffix, v, d, v.voxels(), true, expected);
+    delete [] d;
+
+    // Per-class: the same labels read as obstacle classes, each channel
+    // against the binary transform of its class alone.
+    d = edt::binary_class_edt<uint32_t>(v.labels.data(), v.sx, v.sy, v.sz,
+      v.wx, v.wy, v.wz, 3, black_border, parallel);
+    for (uint32_t c = 1; c <= 3; c++) {
+      Volume single = v;
+      for (size_t i = 0; i < v.voxels(); i++) {
+        single.labels[i] = (v.labels[i] != c);
+      }
+      check.expect("binary_class_edt class " + std::to_string(c) + suffix,
+        single, d + (c - 1) * v.voxels(), v.voxels(), false,
+        [&](const size_t q) { return reference_sq(single, q, true, black_border, 3); });
+    }
+    delete [] d;
+  }
+
+  // Binary, in every representation the nodes feed it
+  Volume v = random_volume(rng, 3, true);
+  const size_t voxels = v.voxels();
+  auto expected = [&](const size_t q) {
+    return reference_sq(v, q, true, black_border, 3);
+  };
+
+  std::vector<uint8_t> labels(voxels);
+  std::vector<uint64_t> packed(edt::packed_words(v.sx, v.sy, v.sz), 0);
+  for (size_t i = 0; i < voxels; i++) {
+    labels[i] = (v.labels[i] != 0);
+    edt::set_packed(packed.data(), v.sx, i, v.labels[i] == 0);
+  }
+
+  float* d = edt::binary_edt<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, black_border, parallel);
+  check.expect("binary_edt 3d" + suffix, v, d, voxels, false, expected);
+  delete [] d;
+
+  d = edt::binary_edtsq<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, black_border, parallel);
+  check.expect("binary_edtsq 3d" + suffix, v, d, voxels, true, expected);
+  delete [] d;
+
+  for (int mode = pyedt::PASS_STRIDED; mode <= pyedt::PASS_SIMD; mode++) {
+    d = edt::binary_edt<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+      v.wx, v.wy, v.wz, black_border, parallel, NULL, (pyedt::PassMode)mode);
+    check.expect("binary_edt 3d mode " + std::to_string(mode) + suffix,
+      v, d, voxels, false, expected);
+    delete [] d;
+  }
+
+  d = edt::binary_edt_packed(packed.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, black_border, parallel);
+  check.expect("binary_edt_packed" + suffix, v, d, voxels, false, expected);
+  delete [] d;
+
+  d = edt::binary_edtsq_packed(packed.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, black_border, parallel);
+  check.expect("binary_edtsq_packed" + suffix, v, d, voxels, true, expected);
+  delete [] d;
+
+  // A few random voxels, repeats included.
+  std::vector<size_t> queries(1 + rng() % 16);
+  for (size_t q = 0; q < queries.size(); q++) {
+    queries[q] = rng() % voxels;
+  }
+  auto expected_query = [&](const size_t q) {
+    return reference_sq(v, queries[q], true, black_border, 3);
+  };
+  d = edt::binary_edt_query<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, queries.data(), queries.size(), black_border, parallel);
+  check.expect("binary_edt_query" + suffix, v, d, queries.size(), false, expected_query);
+  delete [] d;
+
+  d = edt::binary_edt_query_packed(packed.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, queries.data(), queries.size(), black_border, parallel);
+  check.expect("binary_edt_query_packed" + suffix, v, d, queries.size(), false, expected_query);
+  delete [] d;
+
+  // Truncated: the exact transform capped at truncation^2.
+  const float truncation = 0.5f + (rng() % 8);
+  d = edt::binary_edtsq_truncated<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, truncation, black_border, parallel);
+  check.expect("binary_edtsq_truncated" + suffix, v, d, voxels, true,
+    [&](const size_t q) { return std::min(expected(q), truncation * truncation); });
+  delete [] d;
+
+  // Layered: obstacles within z_window slices only.
+  const int z_window = rng() % 3;
+  auto expected_layered = [&](const size_t q) {
+    return reference_sq(v, q, true, black_border, 3, z_window);
+  };
+  d = edt::binary_edtsq_layered<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, z_window, black_border, parallel);
+  check.expect("binary_edtsq_layered" + suffix, v, d, voxels, true, expected_layered);
+  delete [] d;
+
+  d = edt::binary_edt_query<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, queries.data(), queries.size(), black_border, parallel,
+    NULL, z_window);
+  check.expect("binary_edt_query layered" + suffix, v, d, queries.size(), false,
+    [&](const size_t q) { return expected_layered(queries[q]); });
+  delete [] d;
+
+  // Signed field: outside distance in free space, minus the distance to
+  // the nearest free voxel inside obstacles.
+  d = edt::binary_sdf<uint8_t>(labels.data(), v.sx, v.sy, v.sz,
+    v.wx, v.wy, v.wz, black_border, parallel);
+  Volume inverted = v;
+  for (size_t i = 0; i < voxels; i++) {
+    inverted.labels[i] = (v.labels[i] == 0);
+  }
+  std::vector<float> magnitude(voxels);
+  for (size_t i = 0; i < voxels; i++) {
+    magnitude[i] = std::fabs(d[i]);
+  }
+  check.expect("binary_sdf" + suffix, v, magnitude.data(), voxels, false,
+    [&](const size_t q) {
+      return v.labels[q]
+        ? reference_sq(v, q, true, black_border, 3)
+        : reference_sq(inverted, q, true, false, 3);
+    });
+  delete [] d;
+
+  // Feature transform (no black_border variant): the distances, and the
+  // reported obstacle must be at that distance.
+  if (!black_border) {
+    std::vector<float> distances(voxels);
+    int64_t* features = edt::binary_feature_transform<uint8_t>(labels.data(),
+      v.sx, v.sy, v.sz, v.wx, v.wy, v.wz, parallel, NULL, distances.data());
+    check.expect("binary_feature_transform distance", v, distances.data(), voxels,
+      false, expected);
+
+    std::vector<float> feature_sq(voxels);
+    for (size_t i = 0; i < voxels; i++) {
+      if (features[i] < 0) {
+        feature_sq[i] = INFINITY;
+        continue;
+      }
+      const double dx = ((int64_t)(i % v.sx) - features[i] % v.sx) * (double)v.wx;
+      const double dy = ((int64_t)((i / v.sx) % v.sy) - (features[i] / v.sx) % v.sy) * (double)v.wy;
+      const double dz = ((int64_t)(i / ((size_t)v.sx * v.sy)) - features[i] / ((int64_t)v.sx * v.sy)) * (double)v.wz;
+      feature_sq[i] = (v.labels[features[i]] == 0) ? (float)(dx * dx + dy * dy + dz * dz) : -1.0f;
+    }
+    check.expect("binary_feature_transform feature", v, feature_sq.data(), voxels,
+      true, expected);
+    delete [] features;
+  }
+}
+
+// Signed field as octomap_to_edt builds it from two SparseEDTs over a
+// map with unobserved voxels: the distance to observed obstacles in free
+// space, minus the distance to the nearest free or unobserved voxel
+// inside obstacles. The reference is binary_sdf with unobserved voxels
+// free, on the map padded with free space beyond the truncation, capped
+// at the truncation.
+inline void check_sparse_sdf(Checker& check, std::mt19937& rng, const int parallel) {
+  const Volume v = random_volume(rng, 3, true);
+  const float truncation = 1.5f + (rng() % 4);
+  const float w_min = std::min(v.wx, std::min(v.wy, v.wz));
+  const int pad = (int)std::ceil(truncation / w_min) + 1;
+  const int origin[3] = { (int)(rng() % 80) - 40, (int)(rng() % 80) - 40, (int)(rng() % 80) - 40 };
+  std::bernoulli_distribution unobserved(0.2);
+
+  const int px = v.sx + 2 * pad, py = v.sy + 2 * pad, pz = v.sz + 2 * pad;
+  std::vector<uint8_t> padded((size_t)px * py * pz, 1);
+  std::vector<uint8_t> seen(v.voxels());
+  SparseEDT outside(v.wx, v.wy, v.wz, truncation, parallel);
+  SparseEDT inside(v.wx, v.wy, v.wz, truncation, parallel, /*unobserved_free=*/false);
+  for (size_t i = 0; i < v.voxels(); i++) {
+    const int x = i % v.sx, y = (i / v.sx) % v.sy, z = i / (v.sx * v.sy);
+    seen[i] = !unobserved(rng);
+    if (!seen[i]) {
+      continue;
+    }
+    const bool occupied = (v.labels[i] == 0);
+    padded[(x + pad) + px * ((y + pad) + py * (z + pad))] = !occupied;
+    outside.mark(origin[0] + x, origin[1] + y, origin[2] + z, occupied);
+    inside.mark(origin[0] + x, origin[1] + y, origin[2] + z, !occupied);
+  }
+  outside.update();
+  inside.update();
+
+  float* d = edt::binary_sdf<uint8_t>(padded.data(), px, py, pz,
+    v.wx, v.wy, v.wz, false, parallel);
+  check.checks++;
+  for (size_t i = 0; i < v.voxels(); i++) {
+    if (!seen[i]) {
+      continue;
+    }
+    const int x = i % v.sx, y = (i / v.sx) % v.sy, z = i / (v.sx * v.sy);
+    const int k[3] = { origin[0] + x, origin[1] + y, origin[2] + z };
+    const float value = (outside.squared(k[0], k[1], k[2]) > 0.0f)
+      ? outside.distance(k[0], k[1], k[2])
+      : -inside.distance(k[0], k[1], k[2]);
+    const float reference = d[(x + pad) + px * ((y + pad) + py * (z + pad))];
+    const float expected = std::copysign(std::min(std::fabs(reference), truncation), reference);
+    if (std::fabs(value - expected) > 1e-4f * std::max(1.0f, std::fabs(expected))) {
+      check.failures++;
+      printf("FAIL sparse sdf %dx%dx%d w=%gx%gx%g truncation %g at %zu: got %g expected %g\n",
+        v.sx, v.sy, v.sz, v.wx, v.wy, v.wz, truncation, i, value, expected);
+      break;
+    }
+  }
+  delete [] d;
+}
+
+// A Latch on the heap, deleted as soon as wait() returns while pool
+// threads are still counting it down. A count_down that touches the
+// latch after opening it shows up as a use after free under ASan/TSan.
+inline void check_latch(Checker& check, std::mt19937& rng, ThreadPool& pool) {
+  const size_t count = 1 + rng() % 8;
+  Latch* latch = new Latch(count);
+  for (size_t i = 0; i < count; i++) {
+    pool.submit([latch]{ latch->count_down(); });
+  }
+  latch->wait();
+  check.checks++;
+  if (!latch->try_wait()) {
+    check.failures++;
+    printf("FAIL Latch: wait() returned before the latch opened\n");
+  }
+  delete latch;
+}
+
+// Runs trials random configurations of every entry point and returns
+// the number of failures.
+inline int run_edt_checks(const int trials, const unsigned seed, const bool verbose) {
+  std::mt19937 rng(seed);
+  Checker check(verbose);
+
+  const int parallels[] = { 1, 3 };
+  for (int t = 0; t < trials; t++) {
+    const bool black_border = (t % 2 == 1);
+    const int parallel = parallels[(t / 2) % 2];
+    check_1d(check, rng, black_border);
+    check_2d(check, rng, black_border, parallel);
+    check_3d(check, rng, black_border, parallel);
+    check_sparse_sdf(check, rng, parallel);
+  }
+
+  ThreadPool pool(4);
+  for (int t = 0; t < trials; t++) {
+    check_latch(check, rng, pool);
+  }
+
+  printf("edt check: %d of %d configurations failed (seed %u)\n",
+    check.failures, check.checks, seed);
+  return check.failures;
+}
+
+} // namespace edt_check
+
+#endif
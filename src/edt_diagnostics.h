@@ -0,0 +1,114 @@
+/* Thread pool diagnostics for the EDT nodes
+ *
+ * Turns the statistics of the shared EDT executors (see
+ * shared_executor_stats in parallel_executor.h) into a
+ * diagnostic_msgs/DiagnosticArray with one status per executor: worker
+ * utilisation and task counts, the deepest the task queues got and the
+ * enqueue-to-start latency quantiles. Every call resets the counters,
+ * so each message covers the time since the previous one.
+ *
+ * The counters only exist when the package is built with
+ * THREADPOOL_STATS (catkin_make -DTHREADPOOL_STATS=ON); otherwise a
+ * single status says so and the pool carries no instrumentation.
+ *
+ * Nodes that run their maps through a Pipeline (pipeline.h) add a
+ * status with the per-stage counters, which are always on.
+ */
+
+#ifndef EDT_DIAGNOSTICS_H
+#define EDT_DIAGNOSTICS_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <ros/ros.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include "parallel_executor.h"
+
+inline void AddDiagnosticValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const char* format, double value)
+{
+  char text[64];
+  snprintf(text, sizeof(text), format, value);
+  diagnostic_msgs::KeyValue entry;
+  entry.key = key;
+  entry.value = text;
+  status.values.push_back(entry);
+}
+
+inline diagnostic_msgs::DiagnosticArray GetEDTPoolDiagnostics(const std::string& node_name, double period)
+{
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+
+  std::vector<std::pair<size_t, ThreadPoolStats> > pools = shared_executor_stats(/*reset=*/true);
+  if (pools.empty() || !pools[0].second.enabled) {
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = node_name + ": EDT thread pool";
+    status.hardware_id = node_name;
+    status.message = pools.empty() ? "no EDT has run yet" : "built without THREADPOOL_STATS";
+    msg.status.push_back(status);
+    return msg;
+  }
+
+  for (size_t p = 0; p < pools.size(); p++) {
+    const ThreadPoolStats& stats = pools[p].second;
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = node_name + ": EDT thread pool (" + std::to_string(pools[p].first) + " lanes)";
+    status.hardware_id = node_name;
+
+    char message[96];
+    snprintf(message, sizeof(message), "%.0f%% busy, %llu tasks", 100.0*stats.utilisation(), (unsigned long long)stats.tasks());
+    status.message = message;
+
+    AddDiagnosticValue(status, "utilisation", "%.3f", stats.utilisation());
+    AddDiagnosticValue(status, "tasks per second", "%.1f", (period > 0.0) ? stats.tasks()/period : 0.0);
+    AddDiagnosticValue(status, "max queue depth", "%.0f", (double)stats.max_queue_depth);
+    AddDiagnosticValue(status, "latency samples", "%.0f", (double)stats.latency_samples);
+    AddDiagnosticValue(status, "latency p50 (us, at most)", "%.0f", stats.latency_quantile_us(0.5));
+    AddDiagnosticValue(status, "latency p99 (us, at most)", "%.0f", stats.latency_quantile_us(0.99));
+    for (size_t i = 0; i < stats.workers.size(); i++) {
+      const ThreadPoolStats::Worker& worker = stats.workers[i];
+      // The last entry is the calling (node) thread, which never idles in the pool
+      const std::string name = (i + 1 == stats.workers.size()) ? "caller" : "worker " + std::to_string(i);
+      const double total = (double)(worker.busy_ns + worker.idle_ns);
+      AddDiagnosticValue(status, name + " tasks", "%.0f", (double)worker.tasks);
+      AddDiagnosticValue(status, name + " busy (ms)", "%.3f", worker.busy_ns/1.0e6);
+      if (i + 1 < stats.workers.size()) {
+        AddDiagnosticValue(status, name + " utilisation", "%.3f", (total > 0.0) ? worker.busy_ns/total : 0.0);
+      }
+    }
+    msg.status.push_back(status);
+  }
+  return msg;
+}
+
+// Appends a status with the per-stage counters of a Pipeline (see pipeline.h).
+template <typename StageStats>
+void AddPipelineDiagnostics(diagnostic_msgs::DiagnosticArray& msg, const std::string& node_name, const std::vector<StageStats>& stages)
+{
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = node_name + ": map pipeline";
+  status.hardware_id = node_name;
+
+  size_t dropped = 0;
+  for (size_t i = 0; i < stages.size(); i++) {
+    const StageStats& stage = stages[i];
+    dropped += stage.dropped;
+    AddDiagnosticValue(status, stage.name + " processed", "%.0f", (double)stage.processed);
+    AddDiagnosticValue(status, stage.name + " dropped", "%.0f", (double)stage.dropped);
+    AddDiagnosticValue(status, stage.name + " waiting", "%.0f", (double)stage.waiting);
+    AddDiagnosticValue(status, stage.name + " last (ms)", "%.1f", stage.last_ms);
+    AddDiagnosticValue(status, stage.name + " mean (ms)", "%.1f", (stage.processed > 0) ? stage.total_ms/stage.processed : 0.0);
+  }
+
+  char message[96];
+  snprintf(message, sizeof(message), "%llu maps finished, %llu stale maps skipped",
+    (unsigned long long)(stages.empty() ? 0 : stages.back().processed), (unsigned long long)dropped);
+  status.message = message;
+  msg.status.push_back(status);
+}
+
+#endif
@@ -0,0 +1,133 @@
+/* Expand-free octomap leaf rasterization
+ *
+ * The nodes used to call tree->expand() before walking the leaves, so
+ * every pruned region came back one depth-16 voxel at a time. That
+ * multiplies the tree's memory by 8 per pruned level and modifies a
+ * tree other code may still be reading.
+ *
+ * The helpers here walk the leaves as they are stored. A leaf at depth
+ * d covers a cube of 2^(16 - d) voxels per side, passed to the caller
+ * as one KeyBox of voxel keys. The caller can then fill the whole box
+ * into its grid at once (edt::set_packed_box, SparseEDT::mark_box) or
+ * visit only the voxels it needs, such as the bottom layer when looking
+ * for ground. Leaves read straight from a binary stream
+ * (octomap_stream.h) convert to the same boxes.
+ *
+ * Dense grids in the nodes follow xyz_index3: index i along an axis is
+ * the voxel centered at min + i * voxel_size. GridBox maps a key box
+ * onto such a grid given the key of its first voxel, which is
+ * tree.coordToKey(min) as long as min is not on a voxel boundary (the
+ * nodes pad their boxes by 1.5 or 2.95 voxels, which keeps it off).
+ */
+
+#ifndef LEAF_RASTERIZER_H
+#define LEAF_RASTERIZER_H
+
+#include <algorithm>
+#include <octomap/octomap.h>
+#include "octomap_stream.h"
+
+// Voxels lo[a] <= k < hi[a] along every axis
+struct KeyBox {
+  int lo[3];
+  int hi[3];
+
+  bool empty() const {
+    return hi[0] <= lo[0] || hi[1] <= lo[1] || hi[2] <= lo[2];
+  }
+};
+
+inline KeyBox LeafKeyBox(const OctomapLeaf& leaf) {
+  KeyBox box;
+  for (int a = 0; a < 3; a++) {
+    box.lo[a] = leaf.key[a];
+    box.hi[a] = leaf.key[a] + (int)leaf.size;
+  }
+  return box;
+}
+
+// Box of the leaf an octree iterator points at. The key of a leaf
+// above the bottom depth is its center, half an edge above its lowest
+// voxel.
+template <typename Iterator>
+KeyBox LeafKeyBox(const Iterator& it, const unsigned int tree_depth) {
+  const int size = 1 << (tree_depth - it.getDepth());
+  const octomap::OcTreeKey key = it.getKey();
+  KeyBox box;
+  for (int a = 0; a < 3; a++) {
+    box.lo[a] = (int)key[a] - size / 2;
+    box.hi[a] = box.lo[a] + size;
+  }
+  return box;
+}
+
+inline KeyBox ClipKeyBox(const KeyBox& box, const KeyBox& bounds) {
+  KeyBox clipped;
+  for (int a = 0; a < 3; a++) {
+    clipped.lo[a] = std::max(box.lo[a], bounds.lo[a]);
+    clipped.hi[a] = std::min(box.hi[a], bounds.hi[a]);
+  }
+  return clipped;
+}
+
+// The voxels leaf_bbx_iterator treats as inside [min, max].
+template <typename TreeT>
+KeyBox BoundingKeyBox(const TreeT& tree, const octomap::point3d& min, const octomap::point3d& max) {
+  const octomap::OcTreeKey lo = tree.coordToKey(min);
+  const octomap::OcTreeKey hi = tree.coordToKey(max);
+  KeyBox box;
+  for (int a = 0; a < 3; a++) {
+    box.lo[a] = lo[a];
+    box.hi[a] = (int)hi[a] + 1;
+  }
+  return box;
+}
+
+// Calls fn(box, node) once for every leaf of tree.
+template <typename TreeT, typename Fn>
+void ForEachLeafBox(const TreeT& tree, Fn fn) {
+  const unsigned int depth = tree.getTreeDepth();
+  for (typename TreeT::leaf_iterator it = tree.begin_leafs(), end = tree.end_leafs(); it != end; ++it) {
+    fn(LeafKeyBox(it, depth), *it);
+  }
+}
+
+// Calls fn(box, node) once for every leaf overlapping [min, max]. The
+// box is the whole leaf; clip it with ClipKeyBox and BoundingKeyBox to
+// visit only the voxels inside.
+template <typename TreeT, typename Fn>
+void ForEachLeafBox(const TreeT& tree, const octomap::point3d& min, const octomap::point3d& max, Fn fn) {
+  const unsigned int depth = tree.getTreeDepth();
+  for (typename TreeT::leaf_bbx_iterator it = tree.begin_leafs_bbx(min, max), end = tree.end_leafs_bbx(); it != end; ++it) {
+    fn(LeafKeyBox(it, depth), *it);
+  }
+}
+
+// Calls fn(key) for every voxel of box, x fastest.
+template <typename Fn>
+void ForEachBoxVoxel(const KeyBox& box, Fn fn) {
+  octomap::OcTreeKey key;
+  for (int z = box.lo[2]; z < box.hi[2]; z++) {
+    key[2] = z;
+    for (int y = box.lo[1]; y < box.hi[1]; y++) {
+      key[1] = y;
+      for (int x = box.lo[0]; x < box.hi[0]; x++) {
+        key[0] = x;
+        fn(key);
+      }
+    }
+  }
+}
+
+// The grid indices box covers in a grid of size voxels whose first
+// voxel has key origin. Empty if the box misses the grid.
+inline KeyBox GridBox(const KeyBox& box, const octomap::OcTreeKey& origin, const int size[3]) {
+  KeyBox cells;
+  for (int a = 0; a < 3; a++) {
+    cells.lo[a] = std::max(box.lo[a] - (int)origin[a], 0);
+    cells.hi[a] = std::min(box.hi[a] - (int)origin[a], size[a]);
+  }
+  return cells;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/* Background octomap deserialization
+ *
+ * The traversability nodes used to call binaryMsgToMap / fullMsgToMap
+ * in the subscriber callback, so a merged map of a few hundred MB kept
+ * the spin thread (and with it odometry) busy for hundreds of ms, and
+ * the global tree pointer was swapped under whatever was reading it.
+ *
+ * OctomapBuffer<TreeT> decodes on a worker thread with two tree
+ * buffers. submit() only stores the message; a message that has not
+ * been decoded yet is replaced by a newer one. The worker decodes into
+ * the back buffer and publishes it through an atomic pointer.
+ * acquire(), called by the processing thread, swaps the newest complete
+ * tree into the front buffer without copying it. The tree it replaces
+ * goes back to the worker to be freed, so neither thread pays for
+ * deleting a large tree. A published tree nobody acquired is replaced
+ * (and freed) when the next decode finishes, so the processing thread
+ * always finds the newest complete map even while maps arrive faster
+ * than they decode.
+ */
+
+#ifndef OCTOMAP_BUFFER_H
+#define OCTOMAP_BUFFER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+#include <octomap_msgs/conversions.h>
+#include <ros/ros.h>
+
+template <typename TreeT>
+class OctomapBuffer {
+public:
+  // full selects fullMsgToMap (trees with custom node types) over
+  // binaryMsgToMap.
+  explicit OctomapBuffer(const bool full=false)
+    : full(full), started(false), stop(false), ready(NULL), current(NULL) {}
+  ~OctomapBuffer();
+
+  // Queues msg for decoding, replacing any message still waiting. The
+  // worker thread starts on the first call.
+  void submit(const octomap_msgs::Octomap::ConstPtr& msg);
+
+  // Makes the newest decoded tree the front tree. Returns false if
+  // nothing new was decoded since the last call.
+  bool acquire();
+
+  // The front tree, owned by the buffer and valid until the next
+  // successful acquire(). NULL before the first one.
+  TreeT* front() const { return current; }
+
+private:
+  const bool full;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake;
+  // guarded by mutex
+  bool started;
+  bool stop;
+  octomap_msgs::Octomap::ConstPtr pending;
+  std::vector<TreeT*> retired;
+
+  // back buffer handed from the worker to acquire()
+  std::atomic<TreeT*> ready;
+  // front buffer, only touched by the acquiring thread
+  TreeT* current;
+
+  void work();
+
+  OctomapBuffer(const OctomapBuffer&);
+  OctomapBuffer& operator=(const OctomapBuffer&);
+};
+
+template <typename TreeT>
+OctomapBuffer<TreeT>::~OctomapBuffer() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  for (size_t i = 0; i < retired.size(); i++) {
+    delete retired[i];
+  }
+  delete ready.exchange(NULL);
+  delete current;
+}
+
+template <typename TreeT>
+void OctomapBuffer<TreeT>::submit(const octomap_msgs::Octomap::ConstPtr& msg) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    pending = msg;
+    if (!started) {
+      started = true;
+      worker = std::thread(&OctomapBuffer::work, this);
+    }
+  }
+  wake.notify_one();
+}
+
+template <typename TreeT>
+bool OctomapBuffer<TreeT>::acquire() {
+  TreeT* next = ready.exchange(NULL);
+  if (next == NULL) {
+    return false;
+  }
+  if (current != NULL) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      retired.push_back(current);
+    }
+    wake.notify_one();
+  }
+  current = next;
+  return true;
+}
+
+template <typename TreeT>
+void OctomapBuffer<TreeT>::work() {
+  for (;;) {
+    octomap_msgs::Octomap::ConstPtr msg;
+    std::vector<TreeT*> garbage;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this]{ return stop || pending || !retired.empty(); });
+      if (stop) {
+        return;
+      }
+      msg.swap(pending);
+      garbage.swap(retired);
+    }
+
+    for (size_t i = 0; i < garbage.size(); i++) {
+      delete garbage[i];
+    }
+    if (!msg) {
+      continue;
+    }
+
+    octomap::AbstractOcTree* tree = full
+      ? octomap_msgs::fullMsgToMap(*msg)
+      : octomap_msgs::binaryMsgToMap(*msg);
+    msg.reset();
+    TreeT* typed = dynamic_cast<TreeT*>(tree);
+    if (typed == NULL) {
+      ROS_WARN("Octomap message did not decode to the expected tree type, dropping it");
+      delete tree;
+      continue;
+    }
+    // frees a tree nobody picked up
+    delete ready.exchange(typed);
+  }
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include <math.h>
 #include "edt.hpp"
+#include "pipeline.h"
+#include "edt_diagnostics.h"
+#include "leaf_rasterizer.h"
 // Octomap libaries
 #include <octomap/octomap.h>
 #include <octomap/ColorOcTree.h>
@@ -29,18 +32,24 @@ int xyz_index3(const double point[3], double min[3], int size[3], double voxel_s
   return (ind[0] + ind[1]*size[0] + ind[2]*size[0]*size[1]);
 }
 
-void PointCloudEDT(pcl::PointCloud<pcl::PointXYZ>::Ptr input, pcl::PointCloud<pcl::PointXYZ>::Ptr occupied, pcl::PointCloud<pcl::PointXYZI>::Ptr output, double min[3], int size[3], double voxel_size)
+void LogEDTPass(const pyedt::PassPlan& plan)
+{
+  // How each EDT pass was split up, shown with the "edt" debug logger
+  ROS_DEBUG_NAMED("edt", "EDT %s pass: %zu lines x %zu voxels on %zu threads (grain %zu, %.2f ns/voxel estimated), %.3f ms",
+    pyedt::_pass_kind_name(plan.kind), plan.range, plan.length, plan.lanes, plan.grain, plan.ns_per_element, plan.elapsed_ms);
+}
+
+void PointCloudEDT(pcl::PointCloud<pcl::PointXYZ>::Ptr input, pcl::PointCloud<pcl::PointXYZ>::Ptr occupied, pcl::PointCloud<pcl::PointXYZI>::Ptr output, double min[3], int size[3], double voxel_size, int parallel)
 {
   // This function converts input into a nx*ny*nz binary image, calls the edt cpp library, and then stores the values in output.
 
-  // Parse occupied pointcloud values into holder boolean array
-  bool mat[size[0]*size[1]*size[2]];
-  for (int i=0; i<size[0]*size[1]*size[2]; i++) mat[i] = true; // initialize holder array values to true
+  // Parse occupied pointcloud values into a bit-packed occupancy array (set = occupied)
+  uint64_t* mat = new uint64_t[edt::packed_words(size[0], size[1], size[2])](); // initialize holder array values to unoccupied
   for (int i=0; i<occupied->points.size(); i++) {
     double query[3] = {(double)occupied->points[i].x, (double)occupied->points[i].y, (double)occupied->points[i].z};
     int idx = xyz_index3(query, min, size, voxel_size);
     if ((idx >= 0) && (idx < size[0]*size[1]*size[2])) {
-      mat[idx] = false;
+      edt::set_packed(mat, size[0], idx, true);
       // ROS_INFO("Marking cell occupied at (%0.1f, %0.1f, %0.1f)", query[0], query[1], query[2]);
     }
   }
@@ -51,14 +60,16 @@ void PointCloudEDT(pcl::PointCloud<pcl::PointXYZ>::Ptr input, pcl::PointCloud<pc
       double query[3] = {(double)input->points[i].x, (double)input->points[i].y, (double)input->points[i].z - j*voxel_size};
       int idx = xyz_index3(query, min, size, voxel_size);
       if ((idx >= 0) && (idx < size[0]*size[1]*size[2])) {
-        mat[idx] = true;
+        edt::set_packed(mat, size[0], idx, false);
       }
     }
   }
 
-  // Call EDT function
-  float* dt = edt::edt<bool>(mat, /*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
-  /*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*black_border=*/false);
+  // Call EDT function, scaled to meters in its last pass
+  float* dt = edt::binary_edt_packed(mat, /*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
+  /*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*black_border=*/false, parallel, /*output=*/NULL,
+  pyedt::PASS_AUTO, /*scale=*/voxel_size);
+  delete[] mat;
 
   // Parse EDT result into output PointCloud
   for (int i=0; i<input->points.size(); i++) {
@@ -66,7 +77,7 @@ void PointCloudEDT(pcl::PointCloud<pcl::PointXYZ>::Ptr input, pcl::PointCloud<pc
     int idx = xyz_index3(query, min, size, voxel_size);
     pcl::PointXYZI edt_point;
     edt_point.x = (float)query[0]; edt_point.y = (float)query[1]; edt_point.z = (float)query[2];
-    edt_point.intensity = (float)dt[idx]*voxel_size;
+    edt_point.intensity = dt[idx];
     output->points.push_back(edt_point);
   }
 
@@ -74,6 +85,19 @@ void PointCloudEDT(pcl::PointCloud<pcl::PointXYZ>::Ptr input, pcl::PointCloud<pc
   return;
 }
 
+// A map on its way through the pipeline (see pipeline.h)
+struct GroundFrame
+{
+  octomap_msgs::Octomap::ConstPtr msg;
+  std::unique_ptr<octomap::OcTree> tree;
+  std::string frame_id;
+  double resolution = 0.0;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_clustered; // largest ground cluster plus its vertical padding
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_occupied;
+  pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_edt;
+  double min[3], max[3];
+};
+
 // Holder class for params, callback, and published msg
 class GroundFinder
 {
@@ -81,18 +105,58 @@ class GroundFinder
     int min_cluster_size = 200;
     float normal_z_threshold;
     int vertical_padding;
-    sensor_msgs::PointCloud2 ground_msg;
-    sensor_msgs::PointCloud2 edt_msg;
+    int edt_threads = 0; // EDT thread budget, 0 = all cores
+    bool drop_stale_maps = true; // skip maps that arrive while a stage is still busy
+    // Newest results of the pipeline, published by the main loop
+    Latest<std::shared_ptr<const sensor_msgs::PointCloud2> > ground_msg;
+    Latest<std::shared_ptr<const sensor_msgs::PointCloud2> > edt_msg;
     void callbackOctomap(const octomap_msgs::Octomap::ConstPtr msg);
+    void startPipeline();
+    bool decodeMap(GroundFrame& frame);
+    bool extractGround(GroundFrame& frame);
+    bool computeEDT(GroundFrame& frame);
+    bool serializeClouds(GroundFrame& frame);
+    // Declared last so its threads are joined before the fields above go away
+    Pipeline<GroundFrame> pipeline;
 };
 
 void GroundFinder::callbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 {
-	if (msg->data.size() == 0) return;
+  if (msg->data.size() == 0) return;
+  GroundFrame frame;
+  frame.msg = msg;
+  pipeline.push(std::move(frame));
+}
+
+// Decode, ground extraction, EDT and serialization each run on their own thread,
+// so the next map is decoded and searched for ground while the EDT of the
+// previous one runs.
+void GroundFinder::startPipeline()
+{
+  Pipeline<GroundFrame>::Overflow overflow = drop_stale_maps ? Pipeline<GroundFrame>::DROP_OLDEST : Pipeline<GroundFrame>::BLOCK;
+  pipeline.add_stage("decode", [this](GroundFrame& frame) { return decodeMap(frame); }, 1, overflow);
+  pipeline.add_stage("ground", [this](GroundFrame& frame) { return extractGround(frame); }, 1, overflow);
+  pipeline.add_stage("edt", [this](GroundFrame& frame) { return computeEDT(frame); }, 1, overflow);
+  pipeline.add_stage("serialize", [this](GroundFrame& frame) { return serializeClouds(frame); }, 1, overflow);
+  pipeline.start();
+}
 
+bool GroundFinder::decodeMap(GroundFrame& frame)
+{
   // Convert Octomap msg to a tree object
-  octomap::OcTree* tree = new octomap::OcTree(msg->resolution);
-  tree = (octomap::OcTree*)octomap_msgs::binaryMsgToMap(*msg);
+  frame.tree.reset((octomap::OcTree*)octomap_msgs::binaryMsgToMap(*frame.msg));
+  frame.frame_id = frame.msg->header.frame_id;
+  frame.msg.reset();
+  if (!frame.tree) return false;
+  frame.resolution = frame.tree->getResolution();
+  return true;
+}
+
+bool GroundFinder::extractGround(GroundFrame& frame)
+{
+  octomap::OcTree* tree = frame.tree.get();
+  double* min = frame.min;
+  double* max = frame.max;
 
   pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);
   pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_occupied(new pcl::PointCloud<pcl::PointXYZ>);
@@ -101,61 +165,67 @@ void GroundFinder::callbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
   octomap::point3d query, query_neighbor;
   pcl::PointXYZ ground_point;
   pcl::PointXYZ occupied_point;
-  tree->expand();
   ROS_INFO("Beginning tree iteration");
-  for(octomap::OcTree::leaf_iterator it = tree->begin_leafs(),
-       end=tree->end_leafs(); it!=end; ++it)
+  // Pruned leaves are walked as boxes instead of expanding the tree
+  ForEachLeafBox(*tree, [&](const KeyBox& box, const octomap::OcTreeNode& leaf)
   {
     // Skip Occupied nodes
-    // ROS_INFO("Checking occupancy @ (%0.1f, %0.1f, %0.1f)", it.getX(), it.getY(), it.getZ());
-    if (it->getOccupancy() >= 0.3) {
-      if (it->getOccupancy() >= 0.7) {
-        occupied_point.x = it.getX();
-        occupied_point.y = it.getY();
-        occupied_point.z = it.getZ();
-        cloud_occupied->points.push_back(occupied_point);
+    if (leaf.getOccupancy() >= 0.3) {
+      if (leaf.getOccupancy() >= 0.7) {
+        ForEachBoxVoxel(box, [&](const octomap::OcTreeKey& key) {
+          octomap::point3d point = tree->keyToCoord(key);
+          occupied_point.x = point.x();
+          occupied_point.y = point.y();
+          occupied_point.z = point.z();
+          cloud_occupied->points.push_back(occupied_point);
+        });
       }
-      continue;
-    }
-    // Check if bottom neighbor or its neighbors are an occupied voxel
-    // ROS_INFO("Node is free, checking bottom neighbor.");
-    octomap::OcTreeNode* node0 = tree->search(it.getX(), it.getY(), it.getZ() - tree->getResolution());
-    if (node0 == NULL) { // include points that have bottom neighbors that are unseen
-      ground_point.x = it.getX();
-      ground_point.y = it.getY();
-      ground_point.z = it.getZ();
-      cloud->points.push_back(ground_point);
-      continue;
+      return;
     }
+    ForEachBoxVoxel(box, [&](const octomap::OcTreeKey& key) {
+      // All five bottom neighbors of an inner voxel are this free leaf
+      if ((key[2] > box.lo[2]) && (key[0] > box.lo[0]) && (key[0] < box.hi[0] - 1) &&
+          (key[1] > box.lo[1]) && (key[1] < box.hi[1] - 1)) return;
+      octomap::point3d point = tree->keyToCoord(key);
+      // Check if bottom neighbor or its neighbors are an occupied voxel
+      octomap::OcTreeNode* node0 = tree->search(point.x(), point.y(), point.z() - tree->getResolution());
+      if (node0 == NULL) { // include points that have bottom neighbors that are unseen
+        ground_point.x = point.x();
+        ground_point.y = point.y();
+        ground_point.z = point.z();
+        cloud->points.push_back(ground_point);
+        return;
+      }
 
-    std::vector<octomap::OcTreeNode*> bottom_neighbors;
-    octomap::OcTreeNode* node1 = tree->search(it.getX() - tree->getResolution(), it.getY(), it.getZ() - tree->getResolution());
-    octomap::OcTreeNode* node2 = tree->search(it.getX() + tree->getResolution(), it.getY(), it.getZ() - tree->getResolution());
-    octomap::OcTreeNode* node3 = tree->search(it.getX(), it.getY() - tree->getResolution(), it.getZ() - tree->getResolution());
-    octomap::OcTreeNode* node4 = tree->search(it.getX(), it.getY() + tree->getResolution(), it.getZ() - tree->getResolution());
-    bottom_neighbors.push_back(node0);
-    bottom_neighbors.push_back(node1);
-    bottom_neighbors.push_back(node2);
-    bottom_neighbors.push_back(node3);
-    bottom_neighbors.push_back(node4);
-
-    int ground_neighbor_count = 0;
-    for (int i=0; i<5; i++) {
-      if (bottom_neighbors[i] != NULL) { // Might want to count nodes adjacent to nothing as ground as well.
-        if (bottom_neighbors[i]->getOccupancy() >= 0.5) {
-          ground_neighbor_count++;
-          // Add to PCL
-          if ((i == 0) || (ground_neighbor_count == 2)) {
-            ground_point.x = it.getX();
-            ground_point.y = it.getY();
-            ground_point.z = it.getZ();
-            cloud->points.push_back(ground_point);
-            break;
+      std::vector<octomap::OcTreeNode*> bottom_neighbors;
+      octomap::OcTreeNode* node1 = tree->search(point.x() - tree->getResolution(), point.y(), point.z() - tree->getResolution());
+      octomap::OcTreeNode* node2 = tree->search(point.x() + tree->getResolution(), point.y(), point.z() - tree->getResolution());
+      octomap::OcTreeNode* node3 = tree->search(point.x(), point.y() - tree->getResolution(), point.z() - tree->getResolution());
+      octomap::OcTreeNode* node4 = tree->search(point.x(), point.y() + tree->getResolution(), point.z() - tree->getResolution());
+      bottom_neighbors.push_back(node0);
+      bottom_neighbors.push_back(node1);
+      bottom_neighbors.push_back(node2);
+      bottom_neighbors.push_back(node3);
+      bottom_neighbors.push_back(node4);
+
+      int ground_neighbor_count = 0;
+      for (int i=0; i<5; i++) {
+        if (bottom_neighbors[i] != NULL) { // Might want to count nodes adjacent to nothing as ground as well.
+          if (bottom_neighbors[i]->getOccupancy() >= 0.5) {
+            ground_neighbor_count++;
+            // Add to PCL
+            if ((i == 0) || (ground_neighbor_count == 2)) {
+              ground_point.x = point.x();
+              ground_point.y = point.y();
+              ground_point.z = point.z();
+              cloud->points.push_back(ground_point);
+              break;
+            }
           }
         }
       }
-    }
-  }
+    });
+  });
   ROS_INFO("Done.");
 
   // *** WANT TO ADD THIS SO THE ROBOT CAN CHOOSE BETWEEN NAVIGATING STAIRS OR NOT ***
@@ -197,8 +267,7 @@ void GroundFinder::callbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 
   // Extract the largest cluster
   // Also calculate min/max of PCL
-  if (cluster_indices.size() == 0) return;
-  double min[3], max[3];
+  if (cluster_indices.size() == 0) return false;
   min[0] = cloud_filtered->points[cluster_indices[0].indices[0]].x;
   min[1] = cloud_filtered->points[cluster_indices[0].indices[0]].y;
   min[2] = cloud_filtered->points[cluster_indices[0].indices[0]].z;
@@ -244,45 +313,53 @@ void GroundFinder::callbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
     if (padded_point.z > max[2]) max[2] = padded_point.z;
   }
   ROS_INFO("Done.");
-  // Publish the ground (maybe add in the a number of voxels above it for better fast marching)
-  // Declare a new cloud to store the converted message
-  ROS_INFO("Preparing PC2 message for publishing.");
-  sensor_msgs::PointCloud2 new_PC2_msg;
 
-  // Convert from pcl::PointCloud to sensor_msgs::PointCloud2
-  pcl::toROSMsg(*cloud_clustered, new_PC2_msg);
-  // pcl::toROSMsg(*cloud_occupied, new_PC2_msg);
-  new_PC2_msg.header.seq = 1;
-  new_PC2_msg.header.stamp = ros::Time();
-  new_PC2_msg.header.frame_id = msg->header.frame_id;
-
-  // Update the old message
-  ground_msg = new_PC2_msg;
+  frame.cloud_clustered = cloud_clustered;
+  frame.cloud_occupied = cloud_occupied;
+  frame.tree.reset();
+  return true;
+}
 
-  // Call EDT and write to msg
+bool GroundFinder::computeEDT(GroundFrame& frame)
+{
+  // Call EDT
   int size[3];
   for (int i=0; i<3; i++) {
     // Pad the 3d matrix size with empty cells to get rid of EDT edge calculations
-    min[i] = min[i] - 3.0*tree->getResolution();
-    max[i] = max[i] + 3.0*tree->getResolution();
-    size[i] = round((max[i]-min[i])/tree->getResolution()) + 1;
+    frame.min[i] = frame.min[i] - 3.0*frame.resolution;
+    frame.max[i] = frame.max[i] + 3.0*frame.resolution;
+    size[i] = round((frame.max[i]-frame.min[i])/frame.resolution) + 1;
   }
-  pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_edt (new pcl::PointCloud<pcl::PointXYZI>);
-  PointCloudEDT(cloud_clustered, cloud_occupied, cloud_edt, min, size, tree->getResolution());
+  frame.cloud_edt.reset(new pcl::PointCloud<pcl::PointXYZI>);
+  PointCloudEDT(frame.cloud_clustered, frame.cloud_occupied, frame.cloud_edt, frame.min, size, frame.resolution, edt_threads);
+  frame.cloud_occupied.reset();
+  return true;
+}
 
-  pcl::toROSMsg(*cloud_edt, new_PC2_msg);
-  new_PC2_msg.header.seq = 1;
-  new_PC2_msg.header.stamp = ros::Time();
-  new_PC2_msg.header.frame_id = msg->header.frame_id;
+bool GroundFinder::serializeClouds(GroundFrame& frame)
+{
+  // Publish the ground (maybe add in the a number of voxels above it for better fast marching)
+  // Declare a new cloud to store the converted message
+  ROS_INFO("Preparing PC2 message for publishing.");
+  std::shared_ptr<sensor_msgs::PointCloud2> new_ground_msg(new sensor_msgs::PointCloud2);
 
-  // Update the old message
-  edt_msg = new_PC2_msg;
+  // Convert from pcl::PointCloud to sensor_msgs::PointCloud2
+  pcl::toROSMsg(*frame.cloud_clustered, *new_ground_msg);
+  new_ground_msg->header.seq = 1;
+  new_ground_msg->header.stamp = ros::Time();
+  new_ground_msg->header.frame_id = frame.frame_id;
+
+  std::shared_ptr<sensor_msgs::PointCloud2> new_edt_msg(new sensor_msgs::PointCloud2);
+  pcl::toROSMsg(*frame.cloud_edt, *new_edt_msg);
+  new_edt_msg->header.seq = 1;
+  new_edt_msg->header.stamp = ros::Time();
+  new_edt_msg->header.frame_id = frame.frame_id;
+
+  // Update the old messages
+  ground_msg.set(new_ground_msg);
+  edt_msg.set(new_edt_msg);
   ROS_INFO("Callback end.");
-
-  // Delete new pointers
-  delete tree;
-
-  return;
+  return true;
 }
 
 int main(int argc, char **argv)
@@ -297,22 +374,41 @@ int main(int argc, char **argv)
   ros::Subscriber sub = n.subscribe("octomap_binary", 1, &GroundFinder::callbackOctomap, &finder);
   ros::Publisher pub1 = n.advertise<sensor_msgs::PointCloud2>("ground", 5);
   ros::Publisher pub2 = n.advertise<sensor_msgs::PointCloud2>("edt", 5);
+  // EDT thread pool statistics, see edt_diagnostics.h
+  ros::Publisher diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1);
 
   // Params
   n.param("ground_finder/min_cluster_size", finder.min_cluster_size, 100);
   n.param("ground_finder/normal_z_threshold", finder.normal_z_threshold, (float)0.8);
   n.param("ground_finder/vertical_padding", finder.vertical_padding, 2);
+  n.param("ground_finder/edt_threads", finder.edt_threads, 0);
+  n.param("ground_finder/drop_stale_maps", finder.drop_stale_maps, true);
+  edt::set_pass_logger(LogEDTPass);
+  ROS_INFO("EDT thread budget: %d (0 = all cores)", finder.edt_threads);
+  float diagnostics_period;
+  n.param("ground_finder/diagnostics_period", diagnostics_period, (float)5.0);
 
   float update_rate;
   n.param("ground_finder/update_rate", update_rate, (float)5.0);
   ros::Rate r(update_rate); // 5 Hz
+  finder.startPipeline();
 
   // Main Loop
+  ros::Time last_diagnostics = ros::Time::now();
   while (ros::ok())
   {
     r.sleep();
     ros::spinOnce();
-    if (finder.ground_msg.data.size() > 0) pub1.publish(finder.ground_msg);
-    if (finder.edt_msg.data.size() > 0) pub2.publish(finder.edt_msg);
+    std::shared_ptr<const sensor_msgs::PointCloud2> ground_msg = finder.ground_msg.get();
+    if (ground_msg && (ground_msg->data.size() > 0)) pub1.publish(*ground_msg);
+    std::shared_ptr<const sensor_msgs::PointCloud2> edt_msg = finder.edt_msg.get();
+    if (edt_msg && (edt_msg->data.size() > 0)) pub2.publish(*edt_msg);
+    const double since_diagnostics = (ros::Time::now() - last_diagnostics).toSec();
+    if ((diagnostics_period > 0.0) && (since_diagnostics >= diagnostics_period)) {
+      diagnostic_msgs::DiagnosticArray diagnostics = GetEDTPoolDiagnostics("ground_finder", since_diagnostics);
+      AddPipelineDiagnostics(diagnostics, "ground_finder", finder.pipeline.stats());
+      diagnostics_pub.publish(diagnostics);
+      last_diagnostics = ros::Time::now();
+    }
   }
 }
@@ -0,0 +1,106 @@
+/* Direct reader for the octomap binary stream
+ *
+ * A binary octomap message (octomap_msgs::binaryMapToMsg) carries the
+ * tree as written by OcTree::writeBinaryData: a depth-first walk from
+ * the root in which every node is two bytes holding two bits per child,
+ * children 0-3 in the first byte and 4-7 in the second:
+ *
+ *   10  free leaf        01  occupied leaf
+ *   11  inner node       00  no child (unknown space)
+ *
+ * The subtrees of the inner children follow in child order. Child i
+ * lies in the upper half along x if (i & 1), along y if (i & 2) and
+ * along z if (i & 4).
+ *
+ * Building an OcTree from the message, expanding it and walking its
+ * leaves allocates a node for every voxel just to read back what the
+ * stream already says. ReadOctomapBinaryLeaves decodes the stream
+ * straight into a list of leaves, each a cube of voxels given by its
+ * lowest key and its edge length, so a pruned leaf stays a single entry
+ * that callers can fill into a grid as a box.
+ *
+ * Keys match octomap's at full depth (16): voxel key k is centered at
+ * (k - 32768 + 0.5) * resolution.
+ */
+
+#ifndef OCTOMAP_STREAM_H
+#define OCTOMAP_STREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct OctomapLeaf {
+  uint16_t key[3];  // lowest voxel key covered by the leaf
+  uint32_t size;    // edge length in voxels, 2^(16 - depth)
+  bool occupied;
+};
+
+// Appends the leaves of a binary octomap stream to leaves. Returns false
+// if the stream ends in the middle of a node or has bytes left over.
+inline bool ReadOctomapBinaryLeaves(
+    const int8_t* data, const size_t bytes, std::vector<OctomapLeaf>& leaves
+  ) {
+
+  const unsigned int TREE_DEPTH = 16;
+  if (bytes == 0) {
+    return true;  // empty tree
+  }
+
+  struct Pending {
+    uint32_t lo[3];
+    unsigned int depth;
+  };
+  // At most seven siblings wait per level
+  std::vector<Pending> stack;
+  stack.reserve(7 * TREE_DEPTH + 1);
+  Pending root = { { 0, 0, 0 }, 0 };
+  stack.push_back(root);
+
+  size_t pos = 0;
+  while (!stack.empty()) {
+    const Pending node = stack.back();
+    stack.pop_back();
+
+    if (pos + 2 > bytes || node.depth >= TREE_DEPTH) {
+      return false;
+    }
+    const uint16_t bits = (uint8_t)data[pos] | ((uint16_t)(uint8_t)data[pos + 1] << 8);
+    pos += 2;
+
+    const uint32_t half = (uint32_t)1 << (TREE_DEPTH - node.depth - 1);
+    Pending inner[8];
+    int inner_count = 0;
+    for (int i = 0; i < 8; i++) {
+      const unsigned int code = (bits >> (2 * i)) & 3;
+      if (code == 0) {
+        continue;
+      }
+      Pending child;
+      child.lo[0] = node.lo[0] + ((i & 1) ? half : 0);
+      child.lo[1] = node.lo[1] + ((i & 2) ? half : 0);
+      child.lo[2] = node.lo[2] + ((i & 4) ? half : 0);
+      child.depth = node.depth + 1;
+      if (code == 3) {
+        inner[inner_count++] = child;
+        continue;
+      }
+      OctomapLeaf leaf;
+      leaf.key[0] = (uint16_t)child.lo[0];
+      leaf.key[1] = (uint16_t)child.lo[1];
+      leaf.key[2] = (uint16_t)child.lo[2];
+      leaf.size = half;
+      leaf.occupied = (code == 2);
+      leaves.push_back(leaf);
+    }
+
+    // The stream holds the inner children depth first in child order
+    for (int i = inner_count - 1; i >= 0; i--) {
+      stack.push_back(inner[i]);
+    }
+  }
+
+  return pos == bytes;
+}
+
+#endif
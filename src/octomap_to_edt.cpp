@@ -1,5 +1,10 @@
 #include <math.h>
 #include "edt.hpp"
+#include "sparse_edt.h"
+#include "octomap_stream.h"
+#include "leaf_rasterizer.h"
+#include "pipeline.h"
+#include "edt_diagnostics.h"
 // Octomap libaries
 #include <octomap/octomap.h>
 #include <octomap/ColorOcTree.h>
@@ -19,9 +24,6 @@
 // Eigen
 #include <Eigen/Core>
 
-octomap::OcTree* map_octree;
-bool map_updated = false;
-
 void index3_xyz(const int index, double point[3], double min[3], int size[3], double voxel_size)
 {
   // x+y*sizx+z*sizx*sizy
@@ -45,144 +47,252 @@ bool CheckPointInBounds(double p[3], double min[3], double max[3])
   return true;
 }
 
+// A map on its way through the pipeline (see pipeline.h)
+struct EDTFrame
+{
+  octomap_msgs::Octomap::ConstPtr msg;
+  double resolution = 0.0;
+  // Pruned leaves read straight from the message, applied to the
+  // persistent fields by the EDT stage
+  std::vector<OctomapLeaf> leaves;
+  pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud;
+  std::vector<octomap::OcTreeKey> edt_keys;
+  pcl::PointCloud<pcl::PointXYZI>::Ptr occupied_cloud;
+  pcl::PointCloud<pcl::PointXYZINormal>::Ptr sdf_cloud;
+  std::vector<octomap::OcTreeKey> sdf_keys;
+};
+
 class NodeManager
 {
   public:
-    NodeManager()
-    {
-      // map_octree = new octomap::OcTree(0.1);
-    }
     std::string fixed_frame_id;
-    sensor_msgs::PointCloud2 edt_msg;
-    // octomap::OcTree* map_octree;
-    // bool map_updated = false;
     float normal_z_threshold;
     float normal_curvature_threshold;
-    // void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg);
-    void UpdateEDT();
+    float truncation_distance = 3.0; // meters
+    // Owned by the pipeline's edt stage
+    std::unique_ptr<SparseEDT> edt_field;
+    std::unique_ptr<SparseEDT> inside_field; // EDT of the inverted labels, for the signed field
+    double edt_resolution = 0.0;
+    bool publish_sdf = false;
+    int edt_threads = 0; // EDT thread budget, 0 = all cores
+    bool drop_stale_maps = true; // skip maps that arrive while a stage is still busy
+    // Newest results of the pipeline, published by the main loop
+    Latest<std::shared_ptr<const sensor_msgs::PointCloud2> > edt_msg;
+    Latest<std::shared_ptr<const sensor_msgs::PointCloud2> > sdf_msg;
+    void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg);
+    void StartPipeline();
+    bool DecodeMap(EDTFrame& frame);
+    bool ExtractVoxels(EDTFrame& frame);
+    bool UpdateEDT(EDTFrame& frame);
+    bool SerializeClouds(EDTFrame& frame);
+    // Declared last so its threads are joined before the fields above go away
+    Pipeline<EDTFrame> pipeline;
 };
 
-void CalculatePointCloudEDT(bool *occupied_mat, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, double min[3], int size[3], double voxel_size)
+void LogEDTPass(const pyedt::PassPlan& plan)
+{
+  // How each EDT pass was split up, shown with the "edt" debug logger
+  ROS_DEBUG_NAMED("edt", "EDT %s pass: %zu lines x %zu voxels on %zu threads (grain %zu, %.2f ns/voxel estimated), %.3f ms",
+    pyedt::_pass_kind_name(plan.kind), plan.range, plan.length, plan.lanes, plan.grain, plan.ns_per_element, plan.elapsed_ms);
+}
+
+void CalculatePointCloudEDT(SparseEDT* edt_field, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, const std::vector<octomap::OcTreeKey>& edt_keys, double voxel_size)
 {
-  // Call EDT function
-  float* dt = edt::edt<bool>(occupied_mat, /*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
-  /*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*black_border=*/false);
+  // Bring the persistent EDT up to date. Only blocks near voxels that changed
+  // since the last map, and newly observed blocks, are recomputed.
+  edt_field->update();
+  ROS_INFO("EDT recomputed %d of %d blocks (%d bytes)", (int)edt_field->last_work(), (int)edt_field->blocks(), (int)edt_field->bytes());
 
   // Parse EDT result into output PointCloud
-  double max[3];
-  for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
   for (int i=0; i<edt_cloud->points.size(); i++) {
-    double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
-    if (CheckPointInBounds(query, min, max)) {
-      int idx = xyz_index3(query, min, size, voxel_size);
-      float distance = (float)dt[idx]*voxel_size;
-      // if (distance < edt_cloud->points[i].intensity) edt_cloud->points[i].intensity = distance;
-      edt_cloud->points[i].intensity = distance;
+    const octomap::OcTreeKey& key = edt_keys[i];
+    float distance = edt_field->distance(key[0], key[1], key[2])*voxel_size;
+    // if (distance < edt_cloud->points[i].intensity) edt_cloud->points[i].intensity = distance;
+    edt_cloud->points[i].intensity = distance;
+  }
+
+  return;
+}
+
+// Signed distance in voxels: positive in free space, negative inside obstacles.
+// Unobserved space is free on both sides: edt_field measures to observed
+// obstacles only, and inside_field counts unobserved voxels as boundary,
+// so an obstacle next to unknown space is one voxel deep there.
+float SignedDistance(SparseEDT* edt_field, SparseEDT* inside_field, const int x, const int y, const int z)
+{
+  if (edt_field->squared(x, y, z) > 0.0) return edt_field->distance(x, y, z);
+  return -inside_field->distance(x, y, z);
+}
+
+void CalculatePointCloudSDF(SparseEDT* edt_field, SparseEDT* inside_field, pcl::PointCloud<pcl::PointXYZINormal>::Ptr sdf_cloud, const std::vector<octomap::OcTreeKey>& sdf_keys, double voxel_size)
+{
+  inside_field->update();
+
+  // Signed distance and its central-difference gradient, in meters
+  for (int i=0; i<sdf_cloud->points.size(); i++) {
+    const octomap::OcTreeKey& key = sdf_keys[i];
+    int k[3] = {key[0], key[1], key[2]};
+    float value = SignedDistance(edt_field, inside_field, k[0], k[1], k[2]);
+    float gradient[3];
+    for (int axis=0; axis<3; axis++) {
+      k[axis]--;
+      float lo = SignedDistance(edt_field, inside_field, k[0], k[1], k[2]);
+      k[axis] += 2;
+      float hi = SignedDistance(edt_field, inside_field, k[0], k[1], k[2]);
+      k[axis]--;
+      gradient[axis] = pyedt::_sdf_derivative(lo, value, hi, true, true, 1.0);
     }
+    sdf_cloud->points[i].intensity = value*voxel_size;
+    sdf_cloud->points[i].normal_x = gradient[0];
+    sdf_cloud->points[i].normal_y = gradient[1];
+    sdf_cloud->points[i].normal_z = gradient[2];
+    sdf_cloud->points[i].curvature = 0.0;
   }
 
-  delete[] dt;
   return;
 }
 
-void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
+void NodeManager::CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 {
   if (msg->data.size() == 0) return;
-  delete map_octree;
-  map_octree = (octomap::OcTree*)octomap_msgs::binaryMsgToMap(*msg);
-  map_updated = true;
+  EDTFrame frame;
+  frame.msg = msg;
+  pipeline.push(std::move(frame));
 }
 
-void NodeManager::UpdateEDT()
+// Decode, extract, EDT and serialize each run on their own thread, so the next
+// map is decoded and extracted while the EDT of the previous one runs.
+void NodeManager::StartPipeline()
 {
-  // Only run if the map has been updated
-  if (map_updated) {
-    map_updated = false;
-  } else {
-    return;
-  }
+  Pipeline<EDTFrame>::Overflow overflow = drop_stale_maps ? Pipeline<EDTFrame>::DROP_OLDEST : Pipeline<EDTFrame>::BLOCK;
+  pipeline.add_stage("decode", [this](EDTFrame& frame) { return DecodeMap(frame); }, 1, overflow);
+  pipeline.add_stage("extract", [this](EDTFrame& frame) { return ExtractVoxels(frame); }, 1, overflow);
+  pipeline.add_stage("edt", [this](EDTFrame& frame) { return UpdateEDT(frame); }, 1, overflow);
+  pipeline.add_stage("serialize", [this](EDTFrame& frame) { return SerializeClouds(frame); }, 1, overflow);
+  pipeline.start();
+}
 
-  // Get map dimensions
-  double x_min, y_min, z_min, x_max, y_max, z_max;
-  map_octree->getMetricMin(x_min, y_min, z_min);
-  map_octree->getMetricMax(x_max, y_max, z_max);
-  double min[3], max[3];
-  min[0] = x_min; min[1] = y_min; min[2] = z_min;
-  max[0] = x_max; max[1] = y_max; max[2] = z_max;
-  int size[3];
-  for (int i=0; i<3; i++) {
-    min[i] = min[i] - map_octree->getResolution();
-    max[i] = max[i] + map_octree->getResolution();
-    size[i] = std::round((max[i] - min[i])/map_octree->getResolution()) + 1;
+// Reads the leaves out of the binary stream without building an OcTree
+bool NodeManager::DecodeMap(EDTFrame& frame)
+{
+  if (!frame.msg->binary) {
+    ROS_WARN("octomap_to_edt expects a binary octomap, dropping a full one");
+    return false;
+  }
+  frame.resolution = frame.msg->resolution;
+  const bool valid = ReadOctomapBinaryLeaves(frame.msg->data.data(), frame.msg->data.size(), frame.leaves);
+  frame.msg.reset();
+  if (!valid) {
+    ROS_WARN("Truncated octomap stream, dropping it");
+    return false;
   }
+  return true;
+}
+
+bool NodeManager::ExtractVoxels(EDTFrame& frame)
+{
+  frame.edt_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+  frame.occupied_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+  frame.sdf_cloud.reset(new pcl::PointCloud<pcl::PointXYZINormal>);
 
-  ROS_INFO("Got map extent of [%0.2f, %0.2f, %0.2f] to [%0.2f, %0.2f, %0.2f]", min[0], min[1], min[2], max[0], max[1], max[2]);
-  ROS_INFO("Flat matrix dimensions are [%d, %d, %d]", size[0], size[1], size[2]);
-
-  // Allocate occupied flat matrix and free space pointcloud
-  int flat_matrix_length = size[0]*size[1]*size[2];
-  bool* occupied_mat = new bool[flat_matrix_length];
-  ROS_INFO("Allocated %d bytes for occupied flat matrix", sizeof(occupied_mat));
-  for (int i=0; i<flat_matrix_length; i++) occupied_mat[i] = true;
-  ROS_INFO("Initialized all matrix values to unoccupied.");
-  pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud (new pcl::PointCloud<pcl::PointXYZI>);
-  pcl::PointCloud<pcl::PointXYZI>::Ptr occupied_cloud (new pcl::PointCloud<pcl::PointXYZI>);
-
-  map_octree->expand();
-  ROS_INFO("Beginning tree iteration");
-  for(octomap::OcTree::leaf_iterator it = map_octree->begin_leafs(),
-       end=map_octree->end_leafs(); it!=end; ++it) {
-    if (it->getOccupancy() >= 0.6)
-    {
-      // Add to occupied_mat
-      double query[3];
-      query[0] = it.getX(); query[1] = it.getY(); query[2] = it.getZ();
+  ROS_INFO("Beginning leaf iteration over %d leaves", (int)frame.leaves.size());
+  for (size_t i=0; i<frame.leaves.size(); i++) {
+    const OctomapLeaf& leaf = frame.leaves[i];
+    // A pruned leaf stands for every voxel of its cube
+    ForEachBoxVoxel(LeafKeyBox(leaf), [&](const octomap::OcTreeKey& key) {
+      // Voxel centers, as octomap::OcTree::keyToCoord at full depth
+      const float x = ((int)key[0] - 32768 + 0.5)*frame.resolution;
+      const float y = ((int)key[1] - 32768 + 0.5)*frame.resolution;
+      const float z = ((int)key[2] - 32768 + 0.5)*frame.resolution;
+      if (publish_sdf)
+      {
+        pcl::PointXYZINormal sdf_point;
+        sdf_point.x = x; sdf_point.y = y; sdf_point.z = z;
+        frame.sdf_cloud->points.push_back(sdf_point);
+        frame.sdf_keys.push_back(key);
+      }
       pcl::PointXYZI query_point;
-      query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2]; query_point.intensity = 0.0;
-      if (CheckPointInBounds(query, min, max)) {
-        int id = xyz_index3(query, min, size, map_octree->getResolution());
-        occupied_mat[id] = false;
-        occupied_cloud->points.push_back(query_point);
+      query_point.x = x; query_point.y = y; query_point.z = z;
+      if (leaf.occupied)
+      {
+        // Add to occupied_cloud
+        query_point.intensity = 0.0;
+        frame.occupied_cloud->points.push_back(query_point);
       }
-    }
-    else if (it->getOccupancy() <= 0.4)
-    {
-      // Add to edt_cloud
-      double query[3];
-      query[0] = it.getX(); query[1] = it.getY(); query[2] = it.getZ();
-      if (CheckPointInBounds(query, min, max)) {
-        pcl::PointXYZI query_point;
-        query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2];
-        edt_cloud->points.push_back(query_point);
+      else
+      {
+        // Add to edt_cloud
+        frame.edt_cloud->points.push_back(query_point);
+        frame.edt_keys.push_back(key);
       }
-    }
+    });
   }
 
   ROS_INFO("Parsed octomap into a free-space cloud of length %d and an occupied cloud of length %d",
-    edt_cloud->points.size(), occupied_cloud->points.size());
+    (int)frame.edt_cloud->points.size(), (int)frame.occupied_cloud->points.size());
+  return true;
+}
+
+bool NodeManager::UpdateEDT(EDTFrame& frame)
+{
+  // The distance field is stored in blocks keyed by octree key, so memory follows
+  // the mapped volume rather than the map's bounding box.
+  if (!edt_field || (edt_resolution != frame.resolution)) {
+    edt_resolution = frame.resolution;
+    edt_field.reset(new SparseEDT(/*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*truncation=*/truncation_distance/edt_resolution, /*parallel=*/edt_threads));
+    inside_field.reset();
+    if (publish_sdf) inside_field.reset(new SparseEDT(/*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*truncation=*/truncation_distance/edt_resolution, /*parallel=*/edt_threads, /*unobserved_free=*/false));
+  }
+
+  // Whole leaves are filled at once, block by block
+  for (size_t i=0; i<frame.leaves.size(); i++) {
+    const OctomapLeaf& leaf = frame.leaves[i];
+    const int size = leaf.size;
+    edt_field->mark_box(leaf.key[0], leaf.key[1], leaf.key[2], size, size, size, leaf.occupied);
+    // Inside obstacles the distance is measured to the nearest free voxel
+    if (inside_field) inside_field->mark_box(leaf.key[0], leaf.key[1], leaf.key[2], size, size, size, !leaf.occupied);
+  }
+  std::vector<OctomapLeaf>().swap(frame.leaves);
 
   // Run EDT
-  CalculatePointCloudEDT(occupied_mat, edt_cloud, min, size, map_octree->getResolution());
+  CalculatePointCloudEDT(edt_field.get(), frame.edt_cloud, frame.edt_keys, frame.resolution);
 
   ROS_INFO("EDT Calculated.");
 
+  if (inside_field) {
+    CalculatePointCloudSDF(edt_field.get(), inside_field.get(), frame.sdf_cloud, frame.sdf_keys, frame.resolution);
+    ROS_INFO("Signed distance field calculated.");
+  }
+  return true;
+}
+
+bool NodeManager::SerializeClouds(EDTFrame& frame)
+{
+  if (publish_sdf) {
+    std::shared_ptr<sensor_msgs::PointCloud2> sdf(new sensor_msgs::PointCloud2);
+    pcl::toROSMsg(*frame.sdf_cloud, *sdf);
+    sdf->header.seq = 1;
+    sdf->header.stamp = ros::Time();
+    sdf->header.frame_id = fixed_frame_id;
+    sdf_msg.set(sdf);
+  }
+
   // Add occupied pointcloud to the edt
-  for (int i=0; i<occupied_cloud->points.size(); i++) {
-    edt_cloud->points.push_back(occupied_cloud->points[i]);
+  for (int i=0; i<frame.occupied_cloud->points.size(); i++) {
+    frame.edt_cloud->points.push_back(frame.occupied_cloud->points[i]);
   }
 
   ROS_INFO("Copied occupied voxel distance values into edt pointcloud");
 
   // Copy to msg
-  sensor_msgs::PointCloud2 msg;
-  pcl::toROSMsg(*edt_cloud, msg);
-  msg.header.seq = 1;
-  msg.header.stamp = ros::Time();
-  msg.header.frame_id = fixed_frame_id;
-  edt_msg = msg;
-
-  delete[] occupied_mat;
-  return;
+  std::shared_ptr<sensor_msgs::PointCloud2> msg(new sensor_msgs::PointCloud2);
+  pcl::toROSMsg(*frame.edt_cloud, *msg);
+  msg->header.seq = 1;
+  msg->header.stamp = ros::Time();
+  msg->header.frame_id = fixed_frame_id;
+  edt_msg.set(msg);
+
+  return true;
 }
 
 int main(int argc, char **argv)
@@ -194,25 +304,48 @@ int main(int argc, char **argv)
   NodeManager node_manager;
 
   // Subscribers and Publishers
-  ros::Subscriber sub = n.subscribe("octomap_binary", 1, CallbackOctomap);
+  ros::Subscriber sub = n.subscribe("octomap_binary", 1, &NodeManager::CallbackOctomap, &node_manager);
   ros::Publisher pub = n.advertise<sensor_msgs::PointCloud2>("edt", 5);
+  // Signed distance (intensity, meters) and its gradient (normal_x/y/z)
+  ros::Publisher sdf_pub = n.advertise<sensor_msgs::PointCloud2>("sdf", 5);
+  // EDT thread pool statistics, see edt_diagnostics.h
+  ros::Publisher diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1);
 
   ROS_INFO("Initialized subscriber and publishers.");
 
   // Params
   n.param<std::string>("octomap_to_edt/fixed_frame_id", node_manager.fixed_frame_id, "world");
+  n.param("octomap_to_edt/truncation_distance", node_manager.truncation_distance, (float)3.0);
+  n.param("octomap_to_edt/publish_sdf", node_manager.publish_sdf, false);
+  n.param("octomap_to_edt/drop_stale_maps", node_manager.drop_stale_maps, true);
+  n.param("octomap_to_edt/edt_threads", node_manager.edt_threads, 0);
+  edt::set_pass_logger(LogEDTPass);
+  ROS_INFO("EDT thread budget: %d (0 = all cores)", node_manager.edt_threads);
+  float diagnostics_period;
+  n.param("octomap_to_edt/diagnostics_period", diagnostics_period, (float)5.0);
 
   float update_rate;
   n.param("octomap_to_edt/update_rate", update_rate, (float)5.0);
   
   ros::Rate r(update_rate); // 5 Hz
   ROS_INFO("Finished reading params.");
+  node_manager.StartPipeline();
   // Main Loop
+  ros::Time last_diagnostics = ros::Time::now();
   while (ros::ok())
   {
     r.sleep();
     ros::spinOnce();
-    node_manager.UpdateEDT();
-    if (node_manager.edt_msg.data.size() > 0) pub.publish(node_manager.edt_msg);
+    std::shared_ptr<const sensor_msgs::PointCloud2> edt_msg = node_manager.edt_msg.get();
+    if (edt_msg && (edt_msg->data.size() > 0)) pub.publish(*edt_msg);
+    std::shared_ptr<const sensor_msgs::PointCloud2> sdf_msg = node_manager.sdf_msg.get();
+    if (sdf_msg && (sdf_msg->data.size() > 0)) sdf_pub.publish(*sdf_msg);
+    const double since_diagnostics = (ros::Time::now() - last_diagnostics).toSec();
+    if ((diagnostics_period > 0.0) && (since_diagnostics >= diagnostics_period)) {
+      diagnostic_msgs::DiagnosticArray diagnostics = GetEDTPoolDiagnostics("octomap_to_edt", since_diagnostics);
+      AddPipelineDiagnostics(diagnostics, "octomap_to_edt", node_manager.pipeline.stats());
+      diagnostics_pub.publish(diagnostics);
+      last_diagnostics = ros::Time::now();
+    }
   }
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+/* Long-lived parallel-for executor
+ *
+ * ThreadPool is convenient for heterogeneous tasks, but the EDT passes
+ * are all of the form "run the same kernel over N independent lines".
+ * Enqueueing one packaged_task per line costs a heap allocation, a
+ * future and a lock round trip per line, and building a fresh pool for
+ * every transform means creating and joining threads every time.
+ *
+ * ParallelExecutor keeps its workers alive for the lifetime of the
+ * process and splits a range into chunks of `grain` indices. Workers
+ * (and the calling thread) claim chunks from a shared atomic counter;
+ * the lanes are started with one ThreadPool::submit_bulk, so a pass
+ * costs a single job record on the stack rather than one enqueue (and
+ * heap allocation) per line.
+ *
+ * shared_executor(n) hands out process-wide executors so repeated EDT
+ * calls (e.g. every tick of a ROS node) reuse the same threads. n <= 0
+ * means one lane per hardware thread. shared_executor_stats() collects
+ * their pool statistics (only filled in with THREADPOOL_STATS).
+ */
+
+#ifndef PARALLEL_EXECUTOR_H
+#define PARALLEL_EXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "threadpool.h"
+
+class ParallelExecutor {
+public:
+  // threads counts the calling thread, so threads - 1 workers are spawned.
+  explicit ParallelExecutor(const size_t threads)
+    : lanes(std::max(threads, (size_t)1)), pool(lanes - 1) {}
+
+  size_t size() const {
+    return lanes;
+  }
+
+  // Worker statistics of the underlying pool; the last entry covers
+  // the calling threads.
+  ThreadPoolStats stats() const {
+    return pool.stats();
+  }
+
+  void reset_stats() {
+    pool.reset_stats();
+  }
+
+  // Calls fn(begin, end, lane) over [0, range) in chunks of at most
+  // grain indices. lane < size() identifies the thread running the
+  // chunk, so callers can index per-lane scratch memory. At most
+  // max_lanes lanes take part (0 = all of them). Blocks until every
+  // chunk has finished.
+  template <typename F>
+  void parallel_for(
+    const size_t range, const size_t grain, const F& fn,
+    const size_t max_lanes=0
+  );
+
+private:
+  const size_t lanes;
+  ThreadPool pool;
+
+  ParallelExecutor(const ParallelExecutor&);
+  ParallelExecutor& operator=(const ParallelExecutor&);
+};
+
+template <typename F>
+void ParallelExecutor::parallel_for(
+    const size_t range, const size_t grain, const F& fn,
+    const size_t max_lanes
+  ) {
+
+  if (range == 0) {
+    return;
+  }
+
+  const size_t step = std::max(grain, (size_t)1);
+  const size_t chunks = (range + step - 1) / step;
+  const size_t allowed = (max_lanes > 0) ? std::min(lanes, max_lanes) : lanes;
+  const size_t active = std::min(allowed, chunks);
+
+  if (active <= 1) {
+    for (size_t begin = 0; begin < range; begin += step) {
+      fn(begin, std::min(begin + step, range), (size_t)0);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+
+  // Each lane drains chunks until none are left; lane ids are unique
+  // among the lanes running at the same time.
+  pool.submit_bulk(active, [&](const size_t lane) {
+    size_t chunk;
+    while ((chunk = next.fetch_add(1)) < chunks) {
+      const size_t begin = chunk * step;
+      fn(begin, std::min(begin + step, range), lane);
+    }
+  }, /*grain=*/1);
+}
+
+struct ExecutorRegistry {
+  std::mutex mutex;
+  std::map<size_t, std::unique_ptr<ParallelExecutor> > executors;
+};
+
+inline ExecutorRegistry& executor_registry() {
+  static ExecutorRegistry registry;
+  return registry;
+}
+
+// Process-wide executor with the requested number of lanes (all
+// hardware threads if threads <= 0). Executors are created on first use
+// and never torn down, so their threads stay warm across calls.
+inline ParallelExecutor& shared_executor(const int threads) {
+  ExecutorRegistry& registry = executor_registry();
+
+  const size_t lanes = (threads > 0)
+    ? (size_t)threads
+    : std::max(std::thread::hardware_concurrency(), 1u);
+
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  std::unique_ptr<ParallelExecutor>& executor = registry.executors[lanes];
+  if (!executor) {
+    executor.reset(new ParallelExecutor(lanes));
+  }
+  return *executor;
+}
+
+// (lanes, statistics) of every shared executor created so far. With
+// reset, the counters start over after the snapshot, so periodic callers
+// get per-period numbers.
+inline std::vector<std::pair<size_t, ThreadPoolStats> > shared_executor_stats(
+    const bool reset=false
+  ) {
+  ExecutorRegistry& registry = executor_registry();
+  std::vector<std::pair<size_t, ThreadPoolStats> > snapshot;
+
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  std::map<size_t, std::unique_ptr<ParallelExecutor> >::iterator it;
+  for (it = registry.executors.begin(); it != registry.executors.end(); ++it) {
+    snapshot.push_back(std::make_pair(it->first, it->second->stats()));
+    if (reset) {
+      it->second->reset_stats();
+    }
+  }
+  return snapshot;
+}
+
+#endif
@@ -0,0 +1,259 @@
+/* Staged processing pipeline
+ *
+ * The nodes turn every map message into published clouds in a chain
+ * of steps (decode the octomap, extract voxels, run the EDT, serialize
+ * the result), and run them back to back inside ros::spinOnce(). While
+ * the EDT for map N runs, map N+1 sits in the subscriber queue and the
+ * spin thread is blocked.
+ *
+ * Pipeline<Frame> runs each step as a stage on its own thread. A frame
+ * (default constructible and movable) enters the first stage with
+ * push() and is moved from stage to stage; a stage returns false to
+ * drop it. Every stage reads from a bounded queue, so consecutive maps
+ * overlap stage by stage and memory stays bounded. When a stage falls
+ * behind, its queue either blocks the stage feeding it (BLOCK) or
+ * throws away the oldest waiting frame (DROP_OLDEST), so a slow EDT
+ * works on the newest map instead of a backlog of stale ones.
+ *
+ * Latest<T> hands the newest result of the last stage to the thread
+ * that publishes it.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename Frame>
+class Pipeline {
+public:
+  enum Overflow { BLOCK, DROP_OLDEST };
+
+  // Processes a frame in place; false drops it.
+  typedef std::function<bool(Frame&)> Stage;
+
+  struct StageStats {
+    std::string name;
+    size_t processed;
+    size_t dropped;   // stale frames thrown away from the input queue
+    size_t waiting;   // frames in the input queue right now
+    double last_ms;   // time spent on the last frame
+    double total_ms;
+  };
+
+  Pipeline() : running(false) {}
+  ~Pipeline() { stop(); }
+
+  // Appends a stage reading from a queue of at most capacity frames.
+  // Stages can only be added before start().
+  void add_stage(
+    const std::string& name, const Stage& fn,
+    const size_t capacity=1, const Overflow overflow=DROP_OLDEST
+  );
+
+  void start();
+
+  // Offers a frame to the first stage. Blocks only if that stage is
+  // BLOCK and full. Returns false once the pipeline is stopped.
+  bool push(Frame frame);
+
+  // Discards the queued frames, lets the running stages finish their
+  // current frame and joins the threads.
+  void stop();
+
+  std::vector<StageStats> stats() const;
+
+private:
+  struct StageState {
+    std::string name;
+    Stage fn;
+    size_t capacity;
+    Overflow overflow;
+    std::thread thread;
+
+    mutable std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Frame> queue;
+    bool closed;
+
+    // guarded by mutex
+    size_t processed;
+    size_t dropped;
+    double last_ms;
+    double total_ms;
+  };
+
+  std::vector<std::unique_ptr<StageState> > stages;
+  bool running;
+
+  bool offer(StageState& stage, Frame& frame);
+  void run(const size_t index);
+
+  Pipeline(const Pipeline&);
+  Pipeline& operator=(const Pipeline&);
+};
+
+template <typename Frame>
+void Pipeline<Frame>::add_stage(
+    const std::string& name, const Stage& fn,
+    const size_t capacity, const Overflow overflow
+  ) {
+
+  std::unique_ptr<StageState> stage(new StageState());
+  stage->name = name;
+  stage->fn = fn;
+  stage->capacity = std::max(capacity, (size_t)1);
+  stage->overflow = overflow;
+  stage->closed = false;
+  stage->processed = 0;
+  stage->dropped = 0;
+  stage->last_ms = 0.0;
+  stage->total_ms = 0.0;
+  stages.push_back(std::move(stage));
+}
+
+template <typename Frame>
+void Pipeline<Frame>::start() {
+  if (running) {
+    return;
+  }
+  running = true;
+  for (size_t i = 0; i < stages.size(); i++) {
+    stages[i]->closed = false;
+    stages[i]->thread = std::thread(&Pipeline::run, this, i);
+  }
+}
+
+template <typename Frame>
+bool Pipeline<Frame>::push(Frame frame) {
+  if (stages.empty()) {
+    return false;
+  }
+  return offer(*stages[0], frame);
+}
+
+template <typename Frame>
+bool Pipeline<Frame>::offer(StageState& stage, Frame& frame) {
+  std::unique_lock<std::mutex> lock(stage.mutex);
+  if (stage.overflow == BLOCK) {
+    stage.not_full.wait(lock, [&stage]{
+      return stage.closed || stage.queue.size() < stage.capacity;
+    });
+  }
+  if (stage.closed) {
+    return false;
+  }
+  while (stage.queue.size() >= stage.capacity) {
+    stage.queue.pop_front();
+    stage.dropped++;
+  }
+  stage.queue.push_back(std::move(frame));
+  stage.not_empty.notify_one();
+  return true;
+}
+
+template <typename Frame>
+void Pipeline<Frame>::run(const size_t index) {
+  StageState& stage = *stages[index];
+
+  for (;;) {
+    Frame frame;
+    {
+      std::unique_lock<std::mutex> lock(stage.mutex);
+      stage.not_empty.wait(lock, [&stage]{
+        return stage.closed || !stage.queue.empty();
+      });
+      if (stage.closed) {
+        return;
+      }
+      frame = std::move(stage.queue.front());
+      stage.queue.pop_front();
+      stage.not_full.notify_one();
+    }
+
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    const bool keep = stage.fn(frame);
+    const double ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - begin).count();
+    {
+      std::unique_lock<std::mutex> lock(stage.mutex);
+      stage.processed++;
+      stage.last_ms = ms;
+      stage.total_ms += ms;
+    }
+
+    if (keep && index + 1 < stages.size()) {
+      if (!offer(*stages[index + 1], frame)) {
+        return;
+      }
+    }
+  }
+}
+
+template <typename Frame>
+void Pipeline<Frame>::stop() {
+  if (!running) {
+    return;
+  }
+  for (size_t i = 0; i < stages.size(); i++) {
+    std::unique_lock<std::mutex> lock(stages[i]->mutex);
+    stages[i]->closed = true;
+    stages[i]->queue.clear();
+    stages[i]->not_empty.notify_all();
+    stages[i]->not_full.notify_all();
+  }
+  for (size_t i = 0; i < stages.size(); i++) {
+    stages[i]->thread.join();
+  }
+  running = false;
+}
+
+template <typename Frame>
+std::vector<typename Pipeline<Frame>::StageStats> Pipeline<Frame>::stats() const {
+  std::vector<StageStats> snapshot;
+  for (size_t i = 0; i < stages.size(); i++) {
+    const StageState& stage = *stages[i];
+    std::unique_lock<std::mutex> lock(stage.mutex);
+    StageStats entry;
+    entry.name = stage.name;
+    entry.processed = stage.processed;
+    entry.dropped = stage.dropped;
+    entry.waiting = stage.queue.size();
+    entry.last_ms = stage.last_ms;
+    entry.total_ms = stage.total_ms;
+    snapshot.push_back(entry);
+  }
+  return snapshot;
+}
+
+// The newest value handed over by a producer thread. get() returns a
+// copy, so T is typically a shared_ptr to an immutable message.
+template <typename T>
+class Latest {
+public:
+  void set(const T& next) {
+    std::unique_lock<std::mutex> lock(mutex);
+    value = next;
+  }
+
+  T get() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return value;
+  }
+
+private:
+  mutable std::mutex mutex;
+  T value;
+};
+
+#endif
@@ -0,0 +1,509 @@
+/* Block-sparse truncated EDT
+ *
+ * A dense grid over the map's bounding box is mostly empty for long,
+ * thin maps such as tunnels, and its size grows with the box rather
+ * than with what has been observed. SparseEDT stores the map as
+ * BLOCK^3 voxel blocks in a hash map keyed by block coordinates, and
+ * only blocks that contain an observed voxel are allocated.
+ *
+ * The distance field is computed block by block with the same separable
+ * truncated passes as pyedt::_binary_edt3dsq_truncated. The final value
+ * of a voxel only depends on obstacles within the truncation reach, so
+ * the z pass only has to run on observed blocks, the y pass on those
+ * blocks grown by the z reach, and the x pass on those grown again by
+ * the y reach. The intermediate blocks are halos that only exist while
+ * update() runs. Each pass transforms maximal runs of consecutive blocks
+ * along its axis, padded by the reach on both ends. Missing blocks read
+ * as unobserved space (x pass) or as saturated (later passes).
+ *
+ * Memory is proportional to the observed volume. The result on observed
+ * voxels matches a dense truncated EDT over the bounding box bit for bit.
+ *
+ * update() only recomputes observed blocks within reach of a block
+ * whose labels changed, plus newly observed blocks, so small map
+ * changes stay cheap as well.
+ *
+ * Voxel coordinates are integers (e.g. octomap keys). Labels follow the
+ * EDT convention: obstacles are zero and unobserved space is free. With
+ * unobserved_free = false unobserved space is an obstacle instead, which
+ * is what the inverted field of a signed distance needs so that unknown
+ * space stays on the free side of the surface.
+ */
+
+#ifndef SPARSE_EDT_H
+#define SPARSE_EDT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "edt.hpp"
+
+struct BlockIndex {
+  int c[3];
+
+  BlockIndex() {
+    c[0] = 0; c[1] = 0; c[2] = 0;
+  }
+  BlockIndex(const int x, const int y, const int z) {
+    c[0] = x; c[1] = y; c[2] = z;
+  }
+
+  int operator[](const int axis) const {
+    return c[axis];
+  }
+  bool operator==(const BlockIndex& other) const {
+    return c[0] == other.c[0] && c[1] == other.c[1] && c[2] == other.c[2];
+  }
+};
+
+struct BlockIndexHash {
+  size_t operator()(const BlockIndex& b) const {
+    return ((size_t)b.c[0] * 73856093u)
+      ^ ((size_t)b.c[1] * 19349663u)
+      ^ ((size_t)b.c[2] * 83492791u);
+  }
+};
+
+class SparseEDT {
+public:
+  static const int BLOCK = 16;
+  static const int BLOCK_VOXELS = BLOCK * BLOCK * BLOCK;
+
+  SparseEDT(
+    const float wx, const float wy, const float wz,
+    const float truncation, const int parallel=1,
+    const bool unobserved_free=true
+  );
+
+  // Observes a voxel. Labels persist until the voxel is marked again.
+  void mark(const int x, const int y, const int z, const bool occupied);
+
+  // Observes every voxel of the box starting at (x, y, z) with sx * sy *
+  // sz voxels, such as a pruned octomap leaf, with one block lookup per
+  // block instead of one per voxel.
+  void mark_box(
+    const int x, const int y, const int z,
+    const int sx, const int sy, const int sz, const bool occupied
+  );
+
+  // Recomputes every block affected by marks since the last update.
+  void update();
+
+  bool observed(const int x, const int y, const int z) const;
+
+  // Capped squared distance and distance; unobserved voxels saturate (or
+  // are 0 when unobserved space is an obstacle).
+  float squared(const int x, const int y, const int z) const;
+  float distance(const int x, const int y, const int z) const {
+    return std::sqrt(squared(x, y, z));
+  }
+
+  float truncation() const { return trunc; }
+  size_t blocks() const { return store.size(); }
+  size_t bytes() const { return store.size() * sizeof(Block); }
+
+  // Blocks recomputed by the last update.
+  size_t last_work() const { return work; }
+
+private:
+  struct Block {
+    uint8_t labels[BLOCK_VOXELS];
+    float field[BLOCK_VOXELS];
+    bool changed;
+    bool fresh;
+  };
+
+  typedef std::unordered_map<BlockIndex, std::unique_ptr<Block>, BlockIndexHash> BlockStore;
+  typedef std::unordered_map<BlockIndex, std::vector<float>, BlockIndexHash> FieldStore;
+  typedef std::unordered_set<BlockIndex, BlockIndexHash> BlockSet;
+
+  float weights[3];
+  int reach[3];
+  int reach_blocks[3];
+  float trunc;
+  int parallel;
+  uint8_t unobserved_label;
+  size_t work;
+
+  BlockStore store;
+
+  Block& touch(const BlockIndex& index);
+
+  static int floor_div(const int v) {
+    return (v >= 0) ? (v / BLOCK) : -((-v + BLOCK - 1) / BLOCK);
+  }
+  static size_t offset(const int x, const int y, const int z) {
+    return (x - floor_div(x) * BLOCK)
+      + BLOCK * ((y - floor_div(y) * BLOCK) + BLOCK * (z - floor_div(z) * BLOCK));
+  }
+
+  static void dilate(BlockSet& blocks, const int axis, const int radius);
+  static std::vector<std::pair<size_t, size_t> > runs(
+    std::vector<BlockIndex>& blocks, const int axis
+  );
+
+  void label_pass(const std::vector<BlockIndex>& targets, FieldStore& dest);
+  void parabolic_pass(
+    const std::vector<BlockIndex>& targets, const int axis,
+    const FieldStore& source, FieldStore* dest
+  );
+};
+
+inline SparseEDT::SparseEDT(
+    const float wx, const float wy, const float wz,
+    const float truncation, const int parallel,
+    const bool unobserved_free
+  ) : trunc(truncation), parallel(parallel), unobserved_label(unobserved_free), work(0) {
+
+  weights[0] = wx; weights[1] = wy; weights[2] = wz;
+  for (int a = 0; a < 3; a++) {
+    reach[a] = (weights[a] >= trunc)
+      ? 0
+      : (int)std::ceil(trunc / weights[a]);
+    reach_blocks[a] = (reach[a] + BLOCK - 1) / BLOCK;
+  }
+}
+
+// The block at index, allocated (unobserved) on first use.
+inline SparseEDT::Block& SparseEDT::touch(const BlockIndex& index) {
+  std::unique_ptr<Block>& block = store[index];
+  if (!block) {
+    block.reset(new Block());
+    std::fill(block->labels, block->labels + BLOCK_VOXELS, unobserved_label);
+    std::fill(block->field, block->field + BLOCK_VOXELS, unobserved_label ? trunc * trunc : 0.0f);
+    block->fresh = true;
+  }
+  return *block;
+}
+
+inline void SparseEDT::mark(
+    const int x, const int y, const int z, const bool occupied
+  ) {
+
+  Block& block = touch(BlockIndex(floor_div(x), floor_div(y), floor_div(z)));
+
+  const uint8_t label = !occupied;
+  uint8_t& current = block.labels[offset(x, y, z)];
+  if (current != label) {
+    current = label;
+    block.changed = true;
+  }
+}
+
+inline void SparseEDT::mark_box(
+    const int x, const int y, const int z,
+    const int sx, const int sy, const int sz, const bool occupied
+  ) {
+
+  if (sx <= 0 || sy <= 0 || sz <= 0) {
+    return;
+  }
+
+  const uint8_t label = !occupied;
+  const int lo[3] = { x, y, z };
+  const int hi[3] = { x + sx, y + sy, z + sz };
+
+  for (int bz = floor_div(lo[2]); bz <= floor_div(hi[2] - 1); bz++) {
+    for (int by = floor_div(lo[1]); by <= floor_div(hi[1] - 1); by++) {
+      for (int bx = floor_div(lo[0]); bx <= floor_div(hi[0] - 1); bx++) {
+        Block& block = touch(BlockIndex(bx, by, bz));
+
+        // The part of the box inside this block, in block-local voxels
+        const int base[3] = { bx * BLOCK, by * BLOCK, bz * BLOCK };
+        int first[3], last[3];
+        for (int a = 0; a < 3; a++) {
+          first[a] = std::max(lo[a], base[a]) - base[a];
+          last[a] = std::min(hi[a], base[a] + BLOCK) - base[a];
+        }
+
+        for (int vz = first[2]; vz < last[2]; vz++) {
+          for (int vy = first[1]; vy < last[1]; vy++) {
+            uint8_t* row = block.labels + BLOCK * (vy + BLOCK * vz);
+            for (int vx = first[0]; vx < last[0]; vx++) {
+              if (row[vx] != label) {
+                row[vx] = label;
+                block.changed = true;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+inline bool SparseEDT::observed(const int x, const int y, const int z) const {
+  return store.count(BlockIndex(floor_div(x), floor_div(y), floor_div(z))) > 0;
+}
+
+inline float SparseEDT::squared(const int x, const int y, const int z) const {
+  BlockStore::const_iterator it =
+    store.find(BlockIndex(floor_div(x), floor_div(y), floor_div(z)));
+  if (it == store.end()) {
+    return unobserved_label ? trunc * trunc : 0.0f;
+  }
+  return it->second->field[offset(x, y, z)];
+}
+
+// Grows a block set by radius blocks along one axis.
+inline void SparseEDT::dilate(BlockSet& blocks, const int axis, const int radius) {
+  if (radius == 0) {
+    return;
+  }
+  std::vector<BlockIndex> seeds(blocks.begin(), blocks.end());
+  for (size_t i = 0; i < seeds.size(); i++) {
+    for (int d = -radius; d <= radius; d++) {
+      BlockIndex b = seeds[i];
+      b.c[axis] += d;
+      blocks.insert(b);
+    }
+  }
+}
+
+// Sorts blocks into lines along axis and splits them into maximal runs
+// of consecutive blocks, returned as [begin, end) ranges.
+inline std::vector<std::pair<size_t, size_t> > SparseEDT::runs(
+    std::vector<BlockIndex>& blocks, const int axis
+  ) {
+
+  const int u = (axis + 1) % 3;
+  const int v = (axis + 2) % 3;
+  std::sort(blocks.begin(), blocks.end(),
+    [=](const BlockIndex& a, const BlockIndex& b) {
+      if (a[v] != b[v]) return a[v] < b[v];
+      if (a[u] != b[u]) return a[u] < b[u];
+      return a[axis] < b[axis];
+    });
+
+  std::vector<std::pair<size_t, size_t> > ranges;
+  size_t begin = 0;
+  for (size_t i = 1; i <= blocks.size(); i++) {
+    if (i == blocks.size()
+        || blocks[i][u] != blocks[i - 1][u]
+        || blocks[i][v] != blocks[i - 1][v]
+        || blocks[i][axis] != blocks[i - 1][axis] + 1) {
+      ranges.push_back(std::make_pair(begin, i));
+      begin = i;
+    }
+  }
+  return ranges;
+}
+
+// x pass: row distances to the nearest obstacle in the labels.
+inline void SparseEDT::label_pass(
+    const std::vector<BlockIndex>& targets, FieldStore& dest
+  ) {
+
+  std::vector<BlockIndex> blocks(targets);
+  const std::vector<std::pair<size_t, size_t> > ranges = runs(blocks, 0);
+  const int pad = reach_blocks[0];
+  const float cap = trunc * trunc;
+
+  for (size_t i = 0; i < blocks.size(); i++) {
+    dest[blocks[i]].resize(BLOCK_VOXELS);
+  }
+
+  ParallelExecutor& executor = shared_executor(parallel);
+  const size_t run_voxels = blocks.size() * BLOCK_VOXELS / std::max(ranges.size(), (size_t)1);
+  pyedt::_run_pass(executor, pyedt::PASS_KIND_X, ranges.size(), run_voxels,
+    [&](const size_t begin, const size_t end, const size_t /*lane*/) {
+      std::vector<const uint8_t*> src;
+      std::vector<uint8_t> line;
+      std::vector<float> out;
+
+      for (size_t r = begin; r < end; r++) {
+        const BlockIndex first = blocks[ranges[r].first];
+        const int count = (int)(ranges[r].second - ranges[r].first);
+        const int span = count + 2 * pad;
+
+        src.assign(span, NULL);
+        for (int t = 0; t < span; t++) {
+          BlockStore::const_iterator it = store.find(
+            BlockIndex(first[0] - pad + t, first[1], first[2]));
+          if (it != store.end()) {
+            src[t] = it->second->labels;
+          }
+        }
+
+        line.resize(span * BLOCK);
+        out.resize(span * BLOCK);
+        for (int row = 0; row < BLOCK * BLOCK; row++) {
+          bool any = false;
+          for (int t = 0; t < span; t++) {
+            uint8_t* dst = line.data() + t * BLOCK;
+            if (src[t] == NULL) {
+              std::fill(dst, dst + BLOCK, unobserved_label);
+              any = any || (unobserved_label == 0);
+              continue;
+            }
+            std::copy(src[t] + row * BLOCK, src[t] + (row + 1) * BLOCK, dst);
+            any = any || (std::find(dst, dst + BLOCK, 0) != dst + BLOCK);
+          }
+
+          // Rows without an obstacle are entirely beyond the truncation.
+          if (!any) {
+            for (int t = 0; t < count; t++) {
+              float* field = dest.find(blocks[ranges[r].first + t])->second.data();
+              std::fill(field + row * BLOCK, field + (row + 1) * BLOCK, cap);
+            }
+            continue;
+          }
+
+          pyedt::squared_edt_1d_multi_seg<uint8_t>(
+            line.data(), out.data(), span * BLOCK, 1, weights[0], false
+          );
+          for (int t = 0; t < count; t++) {
+            float* field = dest.find(blocks[ranges[r].first + t])->second.data();
+            const float* res = out.data() + (t + pad) * BLOCK;
+            for (int x = 0; x < BLOCK; x++) {
+              field[row * BLOCK + x] = std::fminf(res[x], cap);
+            }
+          }
+        }
+      }
+    });
+}
+
+// y and z passes. With dest == NULL the results go to the stored
+// blocks' fields.
+inline void SparseEDT::parabolic_pass(
+    const std::vector<BlockIndex>& targets, const int axis,
+    const FieldStore& source, FieldStore* dest
+  ) {
+
+  std::vector<BlockIndex> blocks(targets);
+  const std::vector<std::pair<size_t, size_t> > ranges = runs(blocks, axis);
+  const int pad = reach_blocks[axis];
+  const float cap = trunc * trunc;
+  const float anisotropy = weights[axis];
+  const int reach_voxels = reach[axis];
+
+  // Lines run along axis; u is always x, v is whichever axis is left.
+  const int stride = (axis == 1) ? BLOCK : BLOCK * BLOCK;
+  const int v_stride = (axis == 1) ? BLOCK * BLOCK : BLOCK;
+
+  if (dest != NULL) {
+    for (size_t i = 0; i < blocks.size(); i++) {
+      (*dest)[blocks[i]].resize(BLOCK_VOXELS);
+    }
+  }
+
+  ParallelExecutor& executor = shared_executor(parallel);
+  const size_t run_voxels = blocks.size() * BLOCK_VOXELS / std::max(ranges.size(), (size_t)1);
+  pyedt::_run_pass(executor, pyedt::PASS_KIND_PARABOLIC, ranges.size(), run_voxels,
+    [&](const size_t begin, const size_t end, const size_t /*lane*/) {
+      std::vector<const float*> src;
+      std::vector<float*> dst;
+      std::vector<float> line;
+
+      for (size_t r = begin; r < end; r++) {
+        const BlockIndex first = blocks[ranges[r].first];
+        const int count = (int)(ranges[r].second - ranges[r].first);
+        const int span = count + 2 * pad;
+        const int n = span * BLOCK;
+
+        src.assign(span, NULL);
+        for (int t = 0; t < span; t++) {
+          BlockIndex b = first;
+          b.c[axis] += t - pad;
+          FieldStore::const_iterator it = source.find(b);
+          if (it != source.end()) {
+            src[t] = it->second.data();
+          }
+        }
+
+        dst.assign(count, NULL);
+        for (int t = 0; t < count; t++) {
+          const BlockIndex& b = blocks[ranges[r].first + t];
+          dst[t] = (dest == NULL)
+            ? store.find(b)->second->field
+            : dest->find(b)->second.data();
+        }
+
+        pyedt::ParabolicArena& arena = pyedt::_thread_arena(n);
+        line.resize(n);
+        for (int v = 0; v < BLOCK; v++) {
+          for (int u = 0; u < BLOCK; u++) {
+            const int base = u + v * v_stride;
+            for (int t = 0; t < span; t++) {
+              float* out = line.data() + t * BLOCK;
+              if (src[t] == NULL) {
+                std::fill(out, out + BLOCK, cap);
+                continue;
+              }
+              for (int i = 0; i < BLOCK; i++) {
+                out[i] = src[t][base + i * stride];
+              }
+            }
+
+            if (reach_voxels > 0) {
+              pyedt::_squared_edt_1d_parabolic_truncated(
+                line.data(), n, 1, anisotropy, cap, reach_voxels, false, arena
+              );
+            }
+
+            for (int t = 0; t < count; t++) {
+              const float* in = line.data() + (t + pad) * BLOCK;
+              for (int i = 0; i < BLOCK; i++) {
+                dst[t][base + i * stride] = in[i];
+              }
+            }
+          }
+        }
+      }
+    });
+}
+
+inline void SparseEDT::update() {
+  // Observed blocks whose final values can have changed.
+  BlockSet affected;
+  for (BlockStore::iterator it = store.begin(); it != store.end(); ++it) {
+    Block& block = *it->second;
+    if (block.fresh) {
+      affected.insert(it->first);
+    }
+    if (!block.changed) {
+      continue;
+    }
+    for (int dz = -reach_blocks[2]; dz <= reach_blocks[2]; dz++) {
+      for (int dy = -reach_blocks[1]; dy <= reach_blocks[1]; dy++) {
+        for (int dx = -reach_blocks[0]; dx <= reach_blocks[0]; dx++) {
+          const BlockIndex b(it->first[0] + dx, it->first[1] + dy, it->first[2] + dz);
+          if (store.count(b)) {
+            affected.insert(b);
+          }
+        }
+      }
+    }
+  }
+
+  for (BlockStore::iterator it = store.begin(); it != store.end(); ++it) {
+    it->second->changed = false;
+    it->second->fresh = false;
+  }
+
+  work = affected.size();
+  if (affected.empty()) {
+    return;
+  }
+
+  // Halos: the y pass has to cover the z reach, the x pass the y reach too.
+  BlockSet y_blocks(affected);
+  dilate(y_blocks, 2, reach_blocks[2]);
+  BlockSet x_blocks(y_blocks);
+  dilate(x_blocks, 1, reach_blocks[1]);
+
+  FieldStore x_field, y_field;
+  label_pass(std::vector<BlockIndex>(x_blocks.begin(), x_blocks.end()), x_field);
+  parabolic_pass(
+    std::vector<BlockIndex>(y_blocks.begin(), y_blocks.end()), 1, x_field, &y_field);
+  x_field.clear();
+  parabolic_pass(
+    std::vector<BlockIndex>(affected.begin(), affected.end()), 2, y_field, NULL);
+}
+
+#endif
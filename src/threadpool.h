@@ -1,4 +1,4 @@
-/* 
+/*
 Copyright (c) 2012 Jakob Progsch, Václav Zeman
 This software is provided 'as-is', without any express or implied
 warranty. In no event will the authors be held liable for any damages
@@ -20,13 +20,34 @@ May 2019
 - The license file was moved from a seperate file to the top of this one.
 - Created public "join" member function from destructor code.
 - Created public "start" member function from constructor code.
+October 2026
+- Replaced the single mutex/condition variable task queue with one deque
+  per worker. A worker pops its own deque from the back and steals from
+  the front of the others when it runs dry.
+- Added "enqueue_batch" to submit many tasks with one lock per deque.
+- Added "wait_all", which waits for every submitted task without joining
+  the workers.
+- "start" on a running pool joins it first, and "join" runs any tasks left
+  over when the pool has no workers.
+- Added "submit", a fire-and-forget enqueue without the packaged_task,
+  shared_ptr and future.
+- Added "submit_bulk", which runs fn(index) over a range of indices with
+  a single job record on the caller's stack instead of one task per index.
+- Added the "Latch" countdown barrier. The last "count_down" opens it
+  under the mutex, so a waiter may destroy it as soon as "wait" returns.
+- Added optional statistics, compiled in with THREADPOOL_STATS: per-worker
+  busy/idle time and task counts, the deepest the queues got and a
+  histogram of enqueue-to-start latency, read with "stats" and cleared
+  with "reset_stats". Without the define the hooks are empty.
 */
 
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -34,64 +55,385 @@ May 2019
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <cstdint>
+#ifdef THREADPOOL_STATS
+#include <chrono>
+#endif
+
+// Snapshot returned by ThreadPool::stats(). enabled is false, and
+// everything else empty, unless the pool was compiled with
+// THREADPOOL_STATS.
+struct ThreadPoolStats {
+    // bucket 0 counts latencies under 1 us, bucket b those in
+    // [2^(b-1), 2^b) us and the last bucket everything longer
+    static const size_t LATENCY_BUCKETS = 24;
+
+    struct Worker {
+        uint64_t busy_ns;   // running tasks and bulk claims
+        uint64_t idle_ns;   // asleep waiting for work
+        uint64_t tasks;     // tasks and bulk claims run
+    };
+
+    bool enabled;
+    // one entry per worker, then one for the threads outside the pool
+    // that ran tasks (wait_all, join and submit_bulk callers)
+    std::vector<Worker> workers;
+    size_t max_queue_depth;
+    uint64_t latency[LATENCY_BUCKETS];
+    uint64_t latency_samples;
+
+    ThreadPoolStats() : enabled(false), max_queue_depth(0), latency_samples(0) {
+        std::fill(latency, latency + LATENCY_BUCKETS, (uint64_t)0);
+    }
+
+    uint64_t tasks() const {
+        uint64_t total = 0;
+        for(const Worker& worker: workers)
+            total += worker.tasks;
+        return total;
+    }
+
+    // fraction of the workers' time spent running tasks
+    double utilisation() const {
+        uint64_t busy = 0, idle = 0;
+        for(size_t i = 0;i + 1<workers.size();++i) {
+            busy += workers[i].busy_ns;
+            idle += workers[i].idle_ns;
+        }
+        return (busy + idle > 0) ? (double)busy / (double)(busy + idle) : 0.0;
+    }
+
+    // upper edge in microseconds of the bucket holding quantile q of the
+    // latencies (0 without samples)
+    double latency_quantile_us(double q) const {
+        if(latency_samples == 0)
+            return 0.0;
+        const double target = q * (double)latency_samples;
+        uint64_t seen = 0;
+        for(size_t b = 0;b<LATENCY_BUCKETS;++b) {
+            seen += latency[b];
+            if(latency[b] > 0 && (double)seen >= target)
+                return (double)((uint64_t)1 << b);
+        }
+        return (double)((uint64_t)1 << (LATENCY_BUCKETS - 1));
+    }
+};
+
+// Single-use countdown barrier: wait() blocks until count_down has been
+// called count times (or with a total of count). Only the last
+// count_down touches the mutex, and it sets done under it, so once
+// wait() or try_wait() has seen the latch open no count_down is still
+// using it and the latch can be destroyed.
+class Latch {
+public:
+    explicit Latch(size_t count) : count(count), done(count == 0) {}
+    void count_down(size_t n = 1) {
+        if(count.fetch_sub(n) == n) {
+            std::unique_lock<std::mutex> lock(mutex);
+            done = true;
+            condition.notify_all();
+        }
+    }
+    bool try_wait() const {
+        std::unique_lock<std::mutex> lock(mutex);
+        return done;
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]{ return this->done; });
+    }
+    void arrive_and_wait(size_t n = 1) {
+        count_down(n);
+        wait();
+    }
+private:
+    std::atomic<size_t> count;
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+    // guarded by mutex
+    bool done;
+
+    Latch(const Latch&);
+    Latch& operator=(const Latch&);
+};
 
 class ThreadPool {
 public:
     ThreadPool(size_t);
     template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
+    auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    template<class F>
+    void submit(F&& f);
+    template<class F>
+    void submit_bulk(size_t count, const F& fn, size_t grain = 0);
+    void enqueue_batch(std::vector< std::function<void()> > batch);
+    void wait_all();
     void start(size_t);
     void join();
+    size_t size() const { return workers.size(); }
+    // statistics since start or the last reset_stats (see ThreadPoolStats);
+    // don't call either concurrently with start or join
+    ThreadPoolStats stats() const;
+    void reset_stats();
     ~ThreadPool();
 private:
+    // monotonic nanoseconds for the statistics, 0 when compiled out
+    static uint64_t stat_clock() {
+#ifdef THREADPOOL_STATS
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+        return 0;
+#endif
+    }
+
+    struct QueuedTask {
+        std::function<void()> fn;
+#ifdef THREADPOOL_STATS
+        uint64_t enqueued;
+#endif
+        QueuedTask() {}
+        QueuedTask(std::function<void()> fn) : fn(std::move(fn)) {
+#ifdef THREADPOOL_STATS
+            enqueued = stat_clock();
+#endif
+        }
+    };
+
+    // one deque per worker; a pool without workers still has one, which
+    // wait_all and join drain on the calling thread
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<QueuedTask> tasks;
+    };
+
+    // which pool and deque the current thread works for, if any
+    struct WorkerSlot {
+        const ThreadPool* pool;
+        size_t index;
+    };
+    static WorkerSlot& worker_slot() {
+        static thread_local WorkerSlot slot = { NULL, 0 };
+        return slot;
+    }
+
+    // A submit_bulk call. It lives on the submitting thread's stack and is
+    // linked into the bulk list while indices are left to claim; helpers
+    // claim grain indices at a time.
+    struct BulkJob {
+        size_t count;
+        size_t grain;
+        std::atomic<size_t> next;
+        void (*invoke)(const void* fn, size_t begin, size_t end);
+        const void* fn;
+        uint64_t published;
+        Latch finished;
+        // guarded by bulk_mutex
+        BulkJob* link;
+        bool linked;
+        size_t helpers;
+
+        BulkJob(size_t count, size_t grain,
+                void (*invoke)(const void*, size_t, size_t), const void* fn)
+            :   count(count), grain(grain), next(0), invoke(invoke), fn(fn),
+                published(0), finished(count), link(NULL), linked(false),
+                helpers(0) {}
+    };
+    template<class F>
+    static void invoke_bulk(const void* fn, size_t begin, size_t end) {
+        for(size_t i = begin;i<end;++i)
+            (*static_cast<const F*>(fn))(i);
+    }
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
-    // synchronization
-    std::mutex queue_mutex;
+    // the task deques
+    std::vector< std::unique_ptr<TaskQueue> > queues;
+
+    // tasks sitting in a deque / submitted and not finished yet
+    std::atomic<size_t> queued;
+    std::atomic<size_t> unfinished;
+    // round robin deque for tasks submitted from outside the pool
+    std::atomic<size_t> next_queue;
+
+    // synchronization: idle workers sleep on condition, wait_all on done
+    std::mutex sleep_mutex;
     std::condition_variable condition;
-    bool stop;
+    std::atomic<size_t> sleeping;
+    std::mutex done_mutex;
+    std::condition_variable done;
+    std::atomic<bool> stop;
+
+    // bulk jobs with indices left, newest first
+    std::mutex bulk_mutex;
+    std::condition_variable bulk_released;
+    BulkJob* bulk_head;
+    std::atomic<size_t> bulk_jobs;
+
+#ifdef THREADPOOL_STATS
+    struct WorkerCounters {
+        std::atomic<uint64_t> busy_ns;
+        std::atomic<uint64_t> idle_ns;
+        std::atomic<uint64_t> tasks;
+        WorkerCounters() : busy_ns(0), idle_ns(0), tasks(0) {}
+    };
+    // one per worker, the last one shared by threads outside the pool
+    std::vector< std::unique_ptr<WorkerCounters> > counters;
+    std::atomic<size_t> max_depth;
+    std::atomic<uint64_t> latency[ThreadPoolStats::LATENCY_BUCKETS];
+
+    WorkerCounters& own_counters();
+#endif
+    // statistics hooks, empty unless THREADPOOL_STATS is defined
+    void stat_depth(size_t depth);
+    void stat_latency(uint64_t enqueued, uint64_t started);
+    void stat_busy(uint64_t started, uint64_t tasks);
+    void stat_idle(uint64_t since);
+
+    size_t home_queue();
+    void push(size_t home, QueuedTask task);
+    bool pop(size_t home, QueuedTask& task);
+    void run(QueuedTask& task);
+    void wake(size_t count);
+    void work(size_t index);
+    bool help_bulk();
+    void run_bulk(BulkJob& job);
+    void unlink_bulk(BulkJob& job);
 };
- 
+
 // the constructor just launches some amount of workers
 inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+    :   queued(0), unfinished(0), next_queue(0), sleeping(0), stop(false),
+        bulk_head(NULL), bulk_jobs(0)
 {
     start(threads);
 }
 
-void ThreadPool::start(size_t threads) {
+inline void ThreadPool::start(size_t threads) {
+    if(!workers.empty())
+        join();
+
+    queues.clear();
+    for(size_t i = 0;i<std::max(threads, (size_t)1);++i)
+        queues.emplace_back(new TaskQueue());
+
+#ifdef THREADPOOL_STATS
+    counters.clear();
+    for(size_t i = 0;i<threads + 1;++i)
+        counters.emplace_back(new WorkerCounters());
+    reset_stats();
+#endif
+
     stop = false;
     for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-            [this]
-            {
-                for(;;)
-                {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
+        workers.emplace_back([this, i]{ work(i); });
+}
+
+// Workers push to their own deque (so nested tasks stay local and hot in
+// cache); everyone else spreads tasks over the deques round robin.
+inline size_t ThreadPool::home_queue() {
+    const WorkerSlot& slot = worker_slot();
+    if(slot.pool == this)
+        return slot.index;
+    return next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+}
+
+inline void ThreadPool::push(size_t home, QueuedTask task) {
+    std::unique_lock<std::mutex> lock(queues[home]->mutex);
+    queues[home]->tasks.push_back(std::move(task));
+}
+
+// Newest task of the home deque, else the oldest task of another one.
+inline bool ThreadPool::pop(size_t home, QueuedTask& task) {
+    if(queued.load() == 0)
+        return false;
+
+    {
+        std::unique_lock<std::mutex> lock(queues[home]->mutex);
+        if(!queues[home]->tasks.empty()) {
+            task = std::move(queues[home]->tasks.back());
+            queues[home]->tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+
+    for(size_t k = 1;k<queues.size();++k)
+    {
+        TaskQueue& victim = *queues[(home + k) % queues.size()];
+        std::unique_lock<std::mutex> lock(victim.mutex);
+        if(!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::run(QueuedTask& task) {
+    const uint64_t started = stat_clock();
+#ifdef THREADPOOL_STATS
+    stat_latency(task.enqueued, started);
+#endif
+    task.fn();
+    task.fn = nullptr;
+    stat_busy(started, 1);
+    if(--unfinished == 0) {
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.notify_all();
+    }
+}
+
+// Called once new tasks are counted in queued and pushed. Taking
+// sleep_mutex orders the notify after any worker that saw queued == 0
+// has started waiting.
+inline void ThreadPool::wake(size_t count) {
+    if(count == 0 || sleeping.load() == 0)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+    }
+    if(count == 1)
+        condition.notify_one();
+    else
+        condition.notify_all();
+}
+
+inline void ThreadPool::work(size_t index) {
+    worker_slot().pool = this;
+    worker_slot().index = index;
+
+    for(;;)
+    {
+        if(bulk_jobs.load() > 0 && help_bulk())
+            continue;
+
+        QueuedTask task;
+        if(pop(index, task)) {
+            run(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        const uint64_t idle_since = stat_clock();
+        sleeping++;
+        condition.wait(lock,
+            [this]{ return this->stop || this->queued.load() > 0 || this->bulk_jobs.load() > 0; });
+        sleeping--;
+        stat_idle(idle_since);
+        if(stop && queued.load() == 0 && bulk_jobs.load() == 0)
+            break;
+    }
+
+    worker_slot().pool = NULL;
 }
 
 // add new work item to the pool
 template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
+auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
@@ -99,24 +441,174 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
     auto task = std::make_shared< std::packaged_task<return_type()> >(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...)
         );
-        
+
     std::future<return_type> res = task->get_future();
+
+    // don't allow enqueueing after stopping the pool
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    unfinished++;
+    stat_depth(++queued);
+    push(home_queue(), QueuedTask([task](){ (*task)(); }));
+    wake(1);
+    return res;
+}
+
+// add new work item to the pool without a future: the callable is stored
+// as is, so there is no bind, packaged_task or shared state to allocate
+template<class F>
+void ThreadPool::submit(F&& f)
+{
+    // don't allow enqueueing after stopping the pool
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    unfinished++;
+    stat_depth(++queued);
+    push(home_queue(), QueuedTask(std::function<void()>(std::forward<F>(f))));
+    wake(1);
+}
+
+// Runs fn(i) for every i in [0, count) on the workers and the calling
+// thread, and returns once all of them have finished. The job record
+// stays on the caller's stack and is published once, so nothing is
+// allocated or queued per index. Indices are claimed grain at a time
+// (0 picks a grain that gives each thread several claims). fn must not
+// throw.
+template<class F>
+void ThreadPool::submit_bulk(size_t count, const F& fn, size_t grain)
+{
+    if(count == 0)
+        return;
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    if(grain == 0)
+        grain = std::max(count / (4 * (workers.size() + 1)), (size_t)1);
+
+    if(workers.empty() || count <= grain) {
+        invoke_bulk<F>(&fn, 0, count);
+        return;
+    }
+
+    BulkJob job(count, grain, &ThreadPool::invoke_bulk<F>, &fn);
+    job.published = stat_clock();
+    {
+        std::unique_lock<std::mutex> lock(bulk_mutex);
+        job.link = bulk_head;
+        job.linked = true;
+        bulk_head = &job;
+        bulk_jobs++;
+    }
+    // the calling thread takes one of the claims itself
+    wake(std::min(workers.size(), (count + grain - 1) / grain - 1));
+
+    run_bulk(job);
+    job.finished.wait();
+
+    // helpers may still hold the job after claiming past the end
+    std::unique_lock<std::mutex> lock(bulk_mutex);
+    bulk_released.wait(lock, [&job]{ return job.helpers == 0; });
+}
+
+// Joins the newest bulk job, if any, until its indices run out.
+inline bool ThreadPool::help_bulk() {
+    BulkJob* job;
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(bulk_mutex);
+        job = bulk_head;
+        if(job == NULL)
+            return false;
+        job->helpers++;
+    }
+    stat_latency(job->published, stat_clock());
+
+    run_bulk(*job);
 
-        // don't allow enqueueing after stopping the pool
-        if(stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+    std::unique_lock<std::mutex> lock(bulk_mutex);
+    if(--job->helpers == 0)
+        bulk_released.notify_all();
+    return true;
+}
 
-        tasks.emplace([task](){ (*task)(); });
+inline void ThreadPool::run_bulk(BulkJob& job) {
+    for(;;)
+    {
+        const size_t begin = job.next.fetch_add(job.grain);
+        if(begin >= job.count) {
+            unlink_bulk(job);
+            return;
+        }
+        const size_t end = std::min(begin + job.grain, job.count);
+        const uint64_t started = stat_clock();
+        job.invoke(job.fn, begin, end);
+        stat_busy(started, 1);
+        job.finished.count_down(end - begin);
+    }
+}
+
+inline void ThreadPool::unlink_bulk(BulkJob& job) {
+    std::unique_lock<std::mutex> lock(bulk_mutex);
+    if(!job.linked)
+        return;
+    BulkJob** slot = &bulk_head;
+    while(*slot != &job)
+        slot = &(*slot)->link;
+    *slot = job.link;
+    job.linked = false;
+    bulk_jobs--;
+}
+
+// add many work items at once: consecutive tasks are dealt to the deques
+// in blocks, so each deque is locked once per batch
+inline void ThreadPool::enqueue_batch(std::vector< std::function<void()> > batch) {
+    if(batch.empty())
+        return;
+    if(stop)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    unfinished += batch.size();
+    stat_depth(queued += batch.size());
+
+    const size_t count = queues.size();
+    const size_t first = home_queue();
+    const size_t block = (batch.size() + count - 1) / count;
+    for(size_t q = 0, begin = 0;begin<batch.size();++q, begin += block)
+    {
+        const size_t end = std::min(begin + block, batch.size());
+        TaskQueue& target = *queues[(first + q) % count];
+        std::unique_lock<std::mutex> lock(target.mutex);
+        for(size_t i = begin;i<end;++i)
+            target.tasks.push_back(QueuedTask(std::move(batch[i])));
+    }
+
+    wake(batch.size());
+}
+
+// Blocks until every task submitted so far (and any task those submit)
+// has finished, without joining the workers. The calling thread runs
+// queued tasks itself while it waits, so a pool without workers works
+// too. A task can't wait for its own pool, since it is unfinished itself.
+inline void ThreadPool::wait_all() {
+    if(worker_slot().pool == this)
+        throw std::runtime_error("wait_all from inside a ThreadPool task");
+
+    QueuedTask task;
+    while(unfinished.load() > 0)
+    {
+        if(pop(0, task)) {
+            run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [this]{ return this->unfinished.load() == 0; });
     }
-    condition.notify_one();
-    return res;
 }
 
 inline void ThreadPool::join () {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
         stop = true;
     }
     condition.notify_all();
@@ -124,6 +616,98 @@ inline void ThreadPool::join () {
         worker.join();
 
     workers.clear();
+
+    // nobody else is left to run these
+    QueuedTask task;
+    while(pop(0, task))
+        run(task);
+}
+
+#ifdef THREADPOOL_STATS
+inline ThreadPool::WorkerCounters& ThreadPool::own_counters() {
+    const WorkerSlot& slot = worker_slot();
+    if(slot.pool == this)
+        return *counters[slot.index];
+    return *counters.back();
+}
+#endif
+
+inline void ThreadPool::stat_depth(size_t depth) {
+#ifdef THREADPOOL_STATS
+    size_t seen = max_depth.load(std::memory_order_relaxed);
+    while(depth > seen &&
+          !max_depth.compare_exchange_weak(seen, depth, std::memory_order_relaxed))
+        ;
+#else
+    (void)depth;
+#endif
+}
+
+inline void ThreadPool::stat_latency(uint64_t enqueued, uint64_t started) {
+#ifdef THREADPOOL_STATS
+    uint64_t us = (started - enqueued) / 1000;
+    size_t bucket = 0;
+    while(us > 0 && bucket + 1<ThreadPoolStats::LATENCY_BUCKETS) {
+        us >>= 1;
+        ++bucket;
+    }
+    latency[bucket].fetch_add(1, std::memory_order_relaxed);
+#else
+    (void)enqueued;
+    (void)started;
+#endif
+}
+
+inline void ThreadPool::stat_busy(uint64_t started, uint64_t tasks) {
+#ifdef THREADPOOL_STATS
+    WorkerCounters& own = own_counters();
+    own.busy_ns.fetch_add(stat_clock() - started, std::memory_order_relaxed);
+    own.tasks.fetch_add(tasks, std::memory_order_relaxed);
+#else
+    (void)started;
+    (void)tasks;
+#endif
+}
+
+inline void ThreadPool::stat_idle(uint64_t since) {
+#ifdef THREADPOOL_STATS
+    own_counters().idle_ns.fetch_add(stat_clock() - since, std::memory_order_relaxed);
+#else
+    (void)since;
+#endif
+}
+
+inline ThreadPoolStats ThreadPool::stats() const {
+    ThreadPoolStats snapshot;
+#ifdef THREADPOOL_STATS
+    snapshot.enabled = true;
+    for(const std::unique_ptr<WorkerCounters>& own: counters) {
+        ThreadPoolStats::Worker worker;
+        worker.busy_ns = own->busy_ns.load(std::memory_order_relaxed);
+        worker.idle_ns = own->idle_ns.load(std::memory_order_relaxed);
+        worker.tasks = own->tasks.load(std::memory_order_relaxed);
+        snapshot.workers.push_back(worker);
+    }
+    snapshot.max_queue_depth = max_depth.load(std::memory_order_relaxed);
+    for(size_t b = 0;b<ThreadPoolStats::LATENCY_BUCKETS;++b) {
+        snapshot.latency[b] = latency[b].load(std::memory_order_relaxed);
+        snapshot.latency_samples += snapshot.latency[b];
+    }
+#endif
+    return snapshot;
+}
+
+inline void ThreadPool::reset_stats() {
+#ifdef THREADPOOL_STATS
+    for(std::unique_ptr<WorkerCounters>& own: counters) {
+        own->busy_ns = 0;
+        own->idle_ns = 0;
+        own->tasks = 0;
+    }
+    max_depth = queued.load();
+    for(size_t b = 0;b<ThreadPoolStats::LATENCY_BUCKETS;++b)
+        latency[b] = 0;
+#endif
 }
 
 // the destructor joins all threads
@@ -133,4 +717,4 @@ inline ThreadPool::~ThreadPool() {
 
 
 
-#endif
\ No newline at end of file
+#endif
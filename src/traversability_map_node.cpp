@@ -1,5 +1,9 @@
 #include <math.h>
 #include "edt.hpp"
+#include "dynamic_edt.h"
+#include "octomap_buffer.h"
+#include "leaf_rasterizer.h"
+#include "edt_diagnostics.h"
 // Octomap libaries
 #include <octomap/octomap.h>
 #include <octomap/ColorOcTree.h>
@@ -19,8 +23,9 @@
 // Eigen
 #include <Eigen/Core>
 
-octomap::OcTree* map_octree;
+octomap::OcTree* map_octree; // front tree of map_buffer
 bool map_updated = false;
+OctomapBuffer<octomap::OcTree> map_buffer;
 
 void index3_xyz(const int index, double point[3], double min[3], int size[3], double voxel_size)
 {
@@ -51,6 +56,17 @@ struct RobotState
   double sensor_range;
 };
 
+// Persistent distance field for one grid placement. It is updated
+// incrementally for as long as the grid keeps the same origin and size.
+struct PersistentEDT
+{
+  std::unique_ptr<DynamicEDT> field;
+  double min[3] = {0.0, 0.0, 0.0};
+  int size[3] = {0, 0, 0};
+  float truncation = 0.0;
+  int z_window = -1;
+};
+
 class NodeManager
 {
   public:
@@ -77,6 +93,10 @@ class NodeManager
     bool filter_holes = false;
     pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud;
     pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud;
+    int edt_z_window = 0; // slices, -1 for the 3D EDT with wz=100 this node used to run
+    int edt_threads = 0; // EDT thread budget, 0 = all cores
+    PersistentEDT edt_full;
+    PersistentEDT edt_bbx;
     // void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg);
     void CallbackOdometry(const nav_msgs::Odometry msg);
     void FindGroundVoxels(std::string map_size);
@@ -87,26 +107,72 @@ class NodeManager
     // void FilterContiguous();
 };
 
-void CalculatePointCloudEDT(bool *occupied_mat, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, double min[3], int size[3], double voxel_size, float truncation_distance)
+void LogEDTPass(const pyedt::PassPlan& plan)
 {
-  // Call EDT function
-  float* dt = edt::edt<bool>(occupied_mat, /*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
-  /*wx=*/1.0, /*wy=*/1.0, /*wz=*/100.0, /*black_border=*/false);
+  // How each EDT pass was split up, shown with the "edt" debug logger
+  ROS_DEBUG_NAMED("edt", "EDT %s pass: %zu lines x %zu voxels on %zu threads (grain %zu, %.2f ns/voxel estimated), %.3f ms",
+    pyedt::_pass_kind_name(plan.kind), plan.range, plan.length, plan.lanes, plan.grain, plan.ns_per_element, plan.elapsed_ms);
+}
 
-  // Parse EDT result into output PointCloud
+void CalculatePointCloudEDT(PersistentEDT& edt, uint64_t *occupied_bits, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, double min[3], int size[3], double voxel_size, float truncation_distance, int z_window, int parallel)
+{
+  // Grid index of every output point, -1 if it is outside the grid
   double max[3];
   for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
+  std::vector<int> point_index(edt_cloud->points.size(), -1);
+  std::vector<size_t> queries;
+  queries.reserve(edt_cloud->points.size());
   for (int i=0; i<edt_cloud->points.size(); i++) {
     double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
     if (CheckPointInBounds(query, min, max)) {
-      int idx = xyz_index3(query, min, size, voxel_size);
-      float distance = (float)dt[idx]*voxel_size;
+      point_index[i] = queries.size();
+      queries.push_back(xyz_index3(query, min, size, voxel_size));
+    }
+  }
+
+  // Repair the persistent field around the voxels that changed if the grid
+  // is where it was last time. If it moved or changed size, a full field
+  // would be thrown away on the next move anyway, so only evaluate the
+  // voxels that are read back and start tracking from the next update.
+  float truncation = truncation_distance/voxel_size;
+  // Without a z window, the 3D transform with a heavy z weight stands in for
+  // per-slice 2D distances, as before the layered mode existed
+  float wz = (z_window < 0) ? 100.0 : 1.0;
+  bool same_grid = (edt.z_window == z_window) && (edt.truncation == truncation);
+  for (int i=0; i<3; i++) same_grid = same_grid && (edt.size[i] == size[i]) && (std::abs(edt.min[i] - min[i]) < 0.5*voxel_size);
+  std::vector<float> distances(queries.size());
+  if (same_grid) {
+    if (!edt.field) {
+      edt.field.reset(new DynamicEDT(/*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
+      /*wx=*/1.0, /*wy=*/1.0, /*wz=*/wz, /*truncation=*/truncation,
+      parallel, /*z_window=*/z_window));
+    }
+    edt.field->assign_packed(occupied_bits);
+    ROS_INFO("EDT recomputed %d of %d voxels", (int)edt.field->last_work(), (int)edt.field->voxels());
+    for (int i=0; i<queries.size(); i++) distances[i] = edt.field->distance(queries[i]);
+  }
+  else {
+    edt.field.reset();
+    edt.z_window = z_window;
+    edt.truncation = truncation;
+    for (int i=0; i<3; i++) {
+      edt.min[i] = min[i];
+      edt.size[i] = size[i];
+    }
+    edt::binary_edt_query_packed(occupied_bits, size[0], size[1], size[2], 1.0, 1.0, wz,
+      queries.data(), queries.size(), /*black_border=*/false, parallel, distances.data(), z_window);
+    ROS_INFO("EDT evaluated at %d of %d voxels", (int)queries.size(), size[0]*size[1]*size[2]);
+  }
+
+  // Parse EDT result into output PointCloud
+  for (int i=0; i<edt_cloud->points.size(); i++) {
+    if (point_index[i] >= 0) {
+      float distance = distances[point_index[i]]*voxel_size;
       // if (distance < edt_cloud->points[i].intensity) edt_cloud->points[i].intensity = distance;
       edt_cloud->points[i].intensity = std::min(distance, truncation_distance);
     }
   }
 
-  delete[] dt;
   return;
 }
 
@@ -120,10 +186,18 @@ void InflateObstacles(pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, float infl
 
 void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 {
+  // Decoded on the map_buffer thread, so the spin thread stays free for odometry
   if (msg->data.size() == 0) return;
-  delete map_octree;
-  map_octree = (octomap::OcTree*)octomap_msgs::binaryMsgToMap(*msg);
-  map_updated = true;
+  map_buffer.submit(msg);
+}
+
+// Picks up the newest map decoded in the background, if there is one
+void AcquireOctomap()
+{
+  if (map_buffer.acquire()) {
+    map_octree = map_buffer.front();
+    map_updated = true;
+  }
 }
 
 void NodeManager::CallbackOdometry(nav_msgs::Odometry msg)
@@ -238,9 +312,8 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     bbx_size[i] = (int)std::round((bbx_max[i] - bbx_min[i])/voxel_size) + 1;
   }
   int bbx_mat_length = bbx_size[0]*bbx_size[1]*bbx_size[2];
-  // bool occupied_mat[bbx_mat_length];
-  bool* occupied_mat = new bool[bbx_mat_length]; // Allows for more memory allocation
-  for (int i=0; i<bbx_mat_length; i++) occupied_mat[i] = true;
+  // Bit-packed occupancy, one bit per voxel (set = occupied), all unoccupied to start
+  uint64_t* occupied_bits = new uint64_t[edt::packed_words(bbx_size[0], bbx_size[1], bbx_size[2])](); // Allows for more memory allocation
 
   ROS_INFO("Removing the voxels within the bounding box from the ground_cloud of length %d", ground_cloud->points.size());
 
@@ -250,138 +323,49 @@ void NodeManager::FindGroundVoxels(std::string map_size)
   // Initialize a PCL object to hold preliminary ground voxels
   pcl::PointCloud<pcl::PointXYZ>::Ptr ground_cloud_prefilter(new pcl::PointCloud<pcl::PointXYZ>);
 
-  for(octomap::OcTree::leaf_bbx_iterator
-  it = map_octree->begin_leafs_bbx(bbx_min_octomap, bbx_max_octomap);
-  it != map_octree->end_leafs_bbx(); ++it)
+  // Key of the voxel at index 0 of the bounding box grid, see leaf_rasterizer.h
+  octomap::OcTreeKey bbx_origin_key = map_octree->coordToKey(bbx_min_octomap);
+  ForEachLeafBox(*map_octree, bbx_min_octomap, bbx_max_octomap, [&](const KeyBox& box, const octomap::OcTreeNode& leaf)
   {
-    // ROS_INFO("Getting leaf size");
-    double size = it.getSize();
-    int size_in_voxels = std::round(it.getSize()/voxel_size);
-    // ROS_INFO("Checking Occupancy of size %d leaf", size_in_voxels);
-    if (it->getOccupancy() >= 0.3) {
-      if (it->getOccupancy() >= 0.7) {
-        // ROS_INFO("Leaf is occupied.");
-        // ***** // func(it, &occupied_mat)
-        double query[3];
-        if (size_in_voxels == 1) { // Just add it if it's the lowest level voxel
-          // ROS_INFO("Leaf is only one voxel big.");
-          query[0] = it.getX();
-          query[1] = it.getY();
-          query[2] = it.getZ();
-          int id = xyz_index3(query, bbx_min_array, bbx_size, voxel_size);
-          if ((id >=0) && (id < (bbx_size[0]*bbx_size[1]*bbx_size[2]))) occupied_mat[id] = false;
-        } else {
-          // ROS_INFO("Leaf is multiple voxels, iterating through all of them");
-          // Iterate through leaf and mark all voxels in occupied matrix structure as occupied.
-          Eigen::Vector3f lower_left_corner;
-          float d_corner = (size - voxel_size)/2.0;
-          lower_left_corner[0] = it.getX() - d_corner;
-          lower_left_corner[1] = it.getY() - d_corner;
-          lower_left_corner[2] = it.getZ() - d_corner;
-          for (int i=0; i<size_in_voxels; i++) {
-            query[0] = lower_left_corner[0] + i*voxel_size;
-            for (int j=0; j<size_in_voxels; j++) {
-              query[1] = lower_left_corner[1] + j*voxel_size;
-              for (int k=0; k<size_in_voxels; k++) {
-                query[2] = lower_left_corner[2] + k*voxel_size;
-                int id = xyz_index3(query, bbx_min_array, bbx_size, voxel_size);
-                if ((id >=0) && (id < (bbx_size[0]*bbx_size[1]*bbx_size[2]))) occupied_mat[id] = false;
-              }
-            }
-          }
+    if (leaf.getOccupancy() >= 0.3) {
+      if (leaf.getOccupancy() >= 0.7) {
+        // Mark the whole leaf in the occupied matrix structure at once
+        KeyBox cells = GridBox(box, bbx_origin_key, bbx_size);
+        if (!cells.empty()) {
+          edt::set_packed_box(occupied_bits, bbx_size[0], bbx_size[1],
+            cells.lo[0], cells.lo[1], cells.lo[2], cells.hi[0], cells.hi[1], cells.hi[2], true);
         }
-        // ***** //
       }
-      continue;
-    } else {
-      // ROS_INFO("Leaf is free, checking for ground voxels beneath it.");
-      double query[3];
-      if (size_in_voxels == 1) { // Just add it if it's the lowest level voxel and adjacent to ground
-        // ROS_INFO("Leaf is only one voxel big.");
-        query[0] = it.getX();
-        query[1] = it.getY();
-        query[2] = it.getZ();
-        if (!CheckPointInBounds(query, bbx_min_array, bbx_max_array)) continue;
-        // ROS_INFO("Checking if (%0.2f, %0.2f %0.2f) is ground", query[0], query[1], query[2]);
-        // ROS_INFO("Querying node below current voxel.");
-        octomap::OcTreeNode* node = map_octree->search(query[0], query[1], query[2] - voxel_size);
-        // if ((node == nullptr) || (node == 0)) {
-        if (node) {
-          // ROS_INFO("Node is seen.");
-          if (node->getOccupancy() >= 0.48) { // include points that have bottom neighbors that are unseen
-            // ROS_INFO("Voxel below is occupied adding ground voxel.");
-            // If it is, add the point to the ground PCL
-            pcl::PointXYZ ground_point;
-            ground_point.x = query[0];
-            ground_point.y = query[1];
-            ground_point.z = query[2];
-            ground_cloud_prefilter->points.push_back(ground_point);
-            // ROS_INFO("Voxel added.");
-          }
-        }
-        else {
-          // ROS_INFO("Voxel below is unseen adding ground voxel.");
+      return;
+    }
+    // Only the bottom voxels of a free leaf can sit on ground, the rest sit on the leaf itself
+    KeyBox bottom = box;
+    bottom.hi[2] = bottom.lo[2] + 1;
+    ForEachBoxVoxel(bottom, [&](const octomap::OcTreeKey& key) {
+      octomap::point3d point = map_octree->keyToCoord(key);
+      double query[3] = {point.x(), point.y(), point.z()};
+      if (!CheckPointInBounds(query, bbx_min_array, bbx_max_array)) return;
+      // Check if bottom neighbor is occupied or unseen
+      octomap::OcTreeNode* node = map_octree->search(query[0], query[1], query[2] - voxel_size);
+      if (node) {
+        if (node->getOccupancy() >= 0.48) {
           // If it is, add the point to the ground PCL
-          if (filter_holes) {
-            pcl::PointXYZ ground_point;
-            ground_point.x = query[0];
-            ground_point.y = query[1];
-            ground_point.z = query[2];
-            ground_cloud_prefilter->points.push_back(ground_point);
-          }
-          // ROS_INFO("Voxel added.");
-        }
-        // ROS_INFO("Ground node query deleted.");
-      } else {
-        // ROS_INFO("Leaf at [%0.2f, %0.2f, %0.2f] is multiple voxels, iterating through the bottom ones.", it.getX(), it.getY(), it.getZ());
-        // Iterate through bottom voxels of the leaf and mark all voxels in occupied matrix structure as occupied.
-        Eigen::Vector3f lower_left_corner;
-        float d_corner = (size - voxel_size)/2.0;
-        lower_left_corner[0] = it.getX() - d_corner;
-        lower_left_corner[1] = it.getY() - d_corner;
-        lower_left_corner[2] = it.getZ() - d_corner;
-        query[2] = lower_left_corner[2];
-        for (int i=0; i<size_in_voxels; i++) {
-          query[0] = lower_left_corner[0] + i*voxel_size;
-          for (int j=0; j<size_in_voxels; j++) {
-            query[1] = lower_left_corner[1] + j*voxel_size;
-            // ROS_INFO("Checking if (%0.2f, %0.2f %0.2f) is ground", query[0], query[1], query[2]);
-            if (!CheckPointInBounds(query, bbx_min_array, bbx_max_array)) continue;
-            // Check if bottom neighbor is occupied or unseen
-            // ROS_INFO("Querying node below current voxel.");
-            octomap::OcTreeNode* node = map_octree->search(query[0], query[1], query[2] - voxel_size);
-            if (node) {
-              // ROS_INFO("Node is seen.");
-              // std::cout << node << std::endl;
-              if (node->getOccupancy() >= 0.48) { // include points that have bottom neighbors that are unseen
-                // ROS_INFO("Voxel below is occupied , adding ground voxel.");
-                // If it is, add the point to the ground PCL
-                pcl::PointXYZ ground_point;
-                ground_point.x = query[0];
-                ground_point.y = query[1];
-                ground_point.z = query[2];
-                ground_cloud_prefilter->points.push_back(ground_point);
-                // ROS_INFO("Voxel added.");
-              }
-            }
-            else {
-              // ROS_INFO("Voxel below is unseen, adding ground voxel.");
-              // If it is, add the point to the ground PCL
-              if (filter_holes) {
-                pcl::PointXYZ ground_point;
-                ground_point.x = query[0];
-                ground_point.y = query[1];
-                ground_point.z = query[2];
-                ground_cloud_prefilter->points.push_back(ground_point);
-              }
-              // ROS_INFO("Voxel added.");
-            }
-            // ROS_INFO("Ground node query deleted.");
-          }
+          pcl::PointXYZ ground_point;
+          ground_point.x = query[0];
+          ground_point.y = query[1];
+          ground_point.z = query[2];
+          ground_cloud_prefilter->points.push_back(ground_point);
         }
       }
-    }
-  }
+      else if (filter_holes) { // include points that have bottom neighbors that are unseen
+        pcl::PointXYZ ground_point;
+        ground_point.x = query[0];
+        ground_point.y = query[1];
+        ground_point.z = query[2];
+        ground_cloud_prefilter->points.push_back(ground_point);
+      }
+    });
+  });
   // ***** //
 
   ROS_INFO("Normal vector filtering initial ground PointCloud of length %d", ground_cloud_prefilter->points.size());
@@ -456,14 +440,14 @@ void NodeManager::FindGroundVoxels(std::string map_size)
       edt_cloud_bbx->points.push_back(edt_point);
       edt_point.z = edt_point.z + voxel_size; // Padding
       edt_cloud_bbx->points.push_back(edt_point); // Padding
-      // Remove all the occupied cells beneath the ground cloud voxels from the occupied_mat
+      // Remove all the occupied cells beneath the ground cloud voxels from the occupied_bits
       query[2] = query[2] - voxel_size;
       if (CheckPointInBounds(query, bbx_min_array, bbx_max_array)) {
-        occupied_mat[xyz_index3(query, bbx_min_array, bbx_size, voxel_size)] = true;
+        edt::set_packed(occupied_bits, bbx_size[0], xyz_index3(query, bbx_min_array, bbx_size, voxel_size), false);
       }
       query[2] = query[2] - voxel_size;
       if (CheckPointInBounds(query, bbx_min_array, bbx_max_array)) {
-        occupied_mat[xyz_index3(query, bbx_min_array, bbx_size, voxel_size)] = true;
+        edt::set_packed(occupied_bits, bbx_size[0], xyz_index3(query, bbx_min_array, bbx_size, voxel_size), false);
       }
     }
   } else {
@@ -506,7 +490,7 @@ void NodeManager::FindGroundVoxels(std::string map_size)
 
   // EDT Calculation
   ROS_INFO("Calculating EDT.");
-  CalculatePointCloudEDT(occupied_mat, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance);
+  CalculatePointCloudEDT((map_size == "bbx") ? edt_bbx : edt_full, occupied_bits, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_z_window, edt_threads);
   InflateObstacles(edt_cloud_bbx_smaller, inflate_distance);
   ROS_INFO("EDT calculated.");
 
@@ -539,7 +523,7 @@ void NodeManager::FindGroundVoxels(std::string map_size)
 
   GetGroundMsg();
   GetEdtMsg();
-  delete[] occupied_mat;
+  delete[] occupied_bits;
   ROS_INFO("Publishing edt");
   return;
 }
@@ -557,6 +541,8 @@ int main(int argc, char **argv)
   ros::Subscriber sub1 = n.subscribe("odometry", 1, &NodeManager::CallbackOdometry, &node_manager);
   ros::Publisher pub1 = n.advertise<sensor_msgs::PointCloud2>("ground", 5);
   ros::Publisher pub2 = n.advertise<sensor_msgs::PointCloud2>("edt", 5);
+  // EDT thread pool statistics, see edt_diagnostics.h
+  ros::Publisher diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1);
 
   ROS_INFO("Initialized subscriber and publishers.");
 
@@ -569,6 +555,12 @@ int main(int argc, char **argv)
   n.param("traversability_mapping/sensor_range", node_manager.robot.sensor_range, 5.0);
   n.param("traversability_mapping/use_tf", node_manager.use_tf, false);
   n.param("traversability_mapping/truncation_distance", node_manager.truncation_distance, (float)4.0);
+  n.param("traversability_mapping/edt_z_window", node_manager.edt_z_window, 0);
+  n.param("traversability_mapping/edt_threads", node_manager.edt_threads, 0);
+  edt::set_pass_logger(LogEDTPass);
+  ROS_INFO("EDT thread budget: %d (0 = all cores)", node_manager.edt_threads);
+  float diagnostics_period;
+  n.param("traversability_mapping/diagnostics_period", diagnostics_period, (float)5.0);
   n.param("traversability_mapping/inflate_distance", node_manager.inflate_distance, (float)0.0);
   n.param("traversability_mapping/filter_holes", node_manager.filter_holes, false);
   int full_map_ticks = 200;
@@ -581,10 +573,12 @@ int main(int argc, char **argv)
   ROS_INFO("Finished reading params.");
   // Main Loop
   int ticks = 0;
+  ros::Time last_diagnostics = ros::Time::now();
   while (ros::ok())
   {
     r.sleep();
     ros::spinOnce();
+    AcquireOctomap();
     if (map_updated) ticks++;
     if ((ticks % full_map_ticks) == 0) {
       ROS_INFO("Calculating EDT over full map.");
@@ -596,5 +590,10 @@ int main(int argc, char **argv)
     ROS_INFO("ground cloud currently has %d points", node_manager.ground_cloud->points.size());
     if (node_manager.ground_cloud->points.size() > 0) pub1.publish(node_manager.ground_msg);
     if (node_manager.edt_cloud->points.size() > 0) pub2.publish(node_manager.edt_msg);
+    const double since_diagnostics = (ros::Time::now() - last_diagnostics).toSec();
+    if ((diagnostics_period > 0.0) && (since_diagnostics >= diagnostics_period)) {
+      diagnostics_pub.publish(GetEDTPoolDiagnostics("traversability_mapping", since_diagnostics));
+      last_diagnostics = ros::Time::now();
+    }
   }
 }
\ No newline at end of file
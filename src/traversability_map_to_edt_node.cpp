@@ -1,5 +1,9 @@
 #include <math.h>
 #include "edt.hpp"
+#include "dynamic_edt.h"
+#include "octomap_buffer.h"
+#include "leaf_rasterizer.h"
+#include "edt_diagnostics.h"
 // Octomap libaries
 #include <octomap/octomap.h>
 #include <octomap/ColorOcTree.h>
@@ -10,6 +14,7 @@
 #include <ros/ros.h>
 #include <tf/transform_listener.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <nav_msgs/Odometry.h>
 #include <pcl_conversions/pcl_conversions.h>
@@ -21,9 +26,11 @@
 // Eigen
 #include <Eigen/Core>
 
-octomap::OcTree* map_octree;
+octomap::OcTree* map_octree; // front tree of map_buffer
 bool map_updated = false;
-octomap::RoughOcTree* rough_octree;
+octomap::RoughOcTree* rough_octree; // front tree of rough_buffer
+OctomapBuffer<octomap::OcTree> map_buffer(/*full=*/true);
+OctomapBuffer<octomap::RoughOcTree> rough_buffer(/*full=*/true);
 pcl::PointCloud<pcl::PointXYZI>::Ptr rough_cloud (new pcl::PointCloud<pcl::PointXYZI>);
 bool rough_updated = false;
 
@@ -56,12 +63,35 @@ struct RobotState
   double sensor_range;
 };
 
+// Persistent distance field for one grid placement. It is updated
+// incrementally for as long as the grid keeps the same origin and size.
+struct PersistentEDT
+{
+  std::unique_ptr<DynamicEDT> field;
+  double min[3] = {0.0, 0.0, 0.0};
+  int size[3] = {0, 0, 0};
+  float truncation = 0.0;
+  int z_window = -1;
+};
+
+// Obstacle classes of the per-class distance channels, 0 is free space
+enum ObstacleClass
+{
+  OBSTACLE_GEOMETRIC = 1, // ground candidates rejected by the normal filter
+  OBSTACLE_ROUGH = 2, // roughness above max_roughness
+  OBSTACLE_NEGATIVE = 3 // free voxels over unseen space rejected by the normal filter
+};
+const int OBSTACLE_CLASSES = 3;
+const char* OBSTACLE_CLASS_FIELDS[OBSTACLE_CLASSES] = {"geometric_distance", "rough_distance", "negative_distance"};
+
 class NodeManager
 {
   public:
     NodeManager():
     ground_cloud (new pcl::PointCloud<pcl::PointXYZI>),
-    edt_cloud (new pcl::PointCloud<pcl::PointXYZI>)
+    edt_cloud (new pcl::PointCloud<pcl::PointXYZI>),
+    sdf_cloud (new pcl::PointCloud<pcl::PointXYZINormal>),
+    nearest_cloud (new pcl::PointCloud<pcl::PointXYZ>)
     {
       // map_octree = new octomap::OcTree(0.1);
     }
@@ -71,6 +101,7 @@ class NodeManager
     std::string fixed_frame_id;
     sensor_msgs::PointCloud2 ground_msg;
     sensor_msgs::PointCloud2 edt_msg;
+    sensor_msgs::PointCloud2 sdf_msg;
     std::vector<ros::Publisher> debug_publishers;
     bool position_updated = false;
     int min_cluster_size;
@@ -84,6 +115,16 @@ class NodeManager
     int padding = 1;
     pcl::PointCloud<pcl::PointXYZI>::Ptr ground_cloud;
     pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud;
+    int edt_z_window = -1; // slices, -1 for the isotropic 3D EDT
+    int edt_threads = 0; // EDT thread budget, 0 = all cores
+    bool publish_sdf = false;
+    pcl::PointCloud<pcl::PointXYZINormal>::Ptr sdf_cloud;
+    bool publish_nearest_obstacle = false;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud; // nearest obstacle of each edt_cloud point
+    bool publish_obstacle_classes = false;
+    std::vector<float> class_distances; // OBSTACLE_CLASSES distances per edt_cloud point
+    PersistentEDT edt_full;
+    PersistentEDT edt_bbx;
     // void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg);
     void CallbackOdometry(const nav_msgs::Odometry msg);
     void FindGroundVoxels(std::string map_size);
@@ -114,26 +155,177 @@ sensor_msgs::PointCloud2 ConvertCloudToMsg(pcl::PointCloud<pcl::PointXYZI>::Ptr
   return msg;
 }
 
-void CalculatePointCloudEDT(bool *occupied_mat, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, double min[3], int size[3], double voxel_size, float truncation_distance)
+void LogEDTPass(const pyedt::PassPlan& plan)
 {
-  // Call EDT function
-  float* dt = edt::edt<bool>(occupied_mat, /*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
-  /*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*black_border=*/false);
+  // How each EDT pass was split up, shown with the "edt" debug logger
+  ROS_DEBUG_NAMED("edt", "EDT %s pass: %zu lines x %zu voxels on %zu threads (grain %zu, %.2f ns/voxel estimated), %.3f ms",
+    pyedt::_pass_kind_name(plan.kind), plan.range, plan.length, plan.lanes, plan.grain, plan.ns_per_element, plan.elapsed_ms);
+}
 
-  // Parse EDT result into output PointCloud
+void CalculatePointCloudEDT(PersistentEDT& edt, uint64_t *occupied_bits, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, double min[3], int size[3], double voxel_size, float truncation_distance, int z_window, int parallel)
+{
+  // Grid index of every output point, -1 if it is outside the grid
   double max[3];
   for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
+  std::vector<int> point_index(edt_cloud->points.size(), -1);
+  std::vector<size_t> queries;
+  queries.reserve(edt_cloud->points.size());
   for (int i=0; i<edt_cloud->points.size(); i++) {
     double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
     if (CheckPointInBounds(query, min, max)) {
-      int idx = xyz_index3(query, min, size, voxel_size);
-      float distance = (float)dt[idx]*voxel_size;
+      point_index[i] = queries.size();
+      queries.push_back(xyz_index3(query, min, size, voxel_size));
+    }
+  }
+
+  // Repair the persistent field around the voxels that changed if the grid
+  // is where it was last time. If it moved or changed size, a full field
+  // would be thrown away on the next move anyway, so only evaluate the
+  // voxels that are read back and start tracking from the next update.
+  float truncation = truncation_distance/voxel_size;
+  bool same_grid = (edt.z_window == z_window) && (edt.truncation == truncation);
+  for (int i=0; i<3; i++) same_grid = same_grid && (edt.size[i] == size[i]) && (std::abs(edt.min[i] - min[i]) < 0.5*voxel_size);
+  std::vector<float> distances(queries.size());
+  if (same_grid) {
+    if (!edt.field) {
+      edt.field.reset(new DynamicEDT(/*sx=*/size[0], /*sy=*/size[1], /*sz=*/size[2],
+      /*wx=*/1.0, /*wy=*/1.0, /*wz=*/1.0, /*truncation=*/truncation,
+      parallel, /*z_window=*/z_window));
+    }
+    edt.field->assign_packed(occupied_bits);
+    ROS_INFO("EDT recomputed %d of %d voxels", (int)edt.field->last_work(), (int)edt.field->voxels());
+    for (int i=0; i<queries.size(); i++) distances[i] = edt.field->distance(queries[i]);
+  }
+  else {
+    edt.field.reset();
+    edt.z_window = z_window;
+    edt.truncation = truncation;
+    for (int i=0; i<3; i++) {
+      edt.min[i] = min[i];
+      edt.size[i] = size[i];
+    }
+    edt::binary_edt_query_packed(occupied_bits, size[0], size[1], size[2], 1.0, 1.0, 1.0,
+      queries.data(), queries.size(), /*black_border=*/false, parallel, distances.data(), z_window);
+    ROS_INFO("EDT evaluated at %d of %d voxels", (int)queries.size(), size[0]*size[1]*size[2]);
+  }
+
+  // Parse EDT result into output PointCloud
+  for (int i=0; i<edt_cloud->points.size(); i++) {
+    if (point_index[i] >= 0) {
+      float distance = distances[point_index[i]]*voxel_size;
       // if (distance < edt_cloud->points[i].intensity) edt_cloud->points[i].intensity = distance;
       edt_cloud->points[i].intensity = std::min(distance, truncation_distance);
     }
   }
 
-  delete[] dt;
+  return;
+}
+
+void CalculatePointCloudSDF(uint64_t *occupied_bits, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, pcl::PointCloud<pcl::PointXYZINormal>::Ptr sdf_cloud, double min[3], int size[3], double voxel_size, float truncation_distance, int parallel)
+{
+  // Signed distance and its gradient over the whole grid, both in one call
+  int voxels = size[0]*size[1]*size[2];
+  uint8_t* labels = new uint8_t[voxels];
+  for (int i=0; i<voxels; i++) labels[i] = !edt::get_packed(occupied_bits, size[0], i);
+  float* gradient = new float[3*voxels];
+  float* sdf = edt::binary_sdf<uint8_t>(labels, size[0], size[1], size[2], 1.0, 1.0, 1.0, false, parallel, NULL, gradient);
+
+  // Sample it at the EDT cloud points and at every occupied voxel. Clamped values
+  // are flat, so their gradient is zero.
+  sdf_cloud->points.clear();
+  double max[3];
+  for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
+  std::vector<int> indices;
+  for (int i=0; i<edt_cloud->points.size(); i++) {
+    double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
+    if (CheckPointInBounds(query, min, max)) indices.push_back(xyz_index3(query, min, size, voxel_size));
+  }
+  for (int i=0; i<voxels; i++) {
+    if (!labels[i]) indices.push_back(i);
+  }
+  for (int i=0; i<indices.size(); i++) {
+    int idx = indices[i];
+    double point[3];
+    index3_xyz(idx, point, min, size, voxel_size);
+    pcl::PointXYZINormal sdf_point;
+    sdf_point.x = point[0]; sdf_point.y = point[1]; sdf_point.z = point[2];
+    float distance = sdf[idx]*voxel_size;
+    bool clamped = (std::abs(distance) >= truncation_distance);
+    sdf_point.intensity = std::max(std::min(distance, truncation_distance), -truncation_distance);
+    sdf_point.normal_x = clamped ? 0.0 : gradient[3*idx];
+    sdf_point.normal_y = clamped ? 0.0 : gradient[3*idx+1];
+    sdf_point.normal_z = clamped ? 0.0 : gradient[3*idx+2];
+    sdf_point.curvature = 0.0;
+    sdf_cloud->points.push_back(sdf_point);
+  }
+
+  delete[] labels;
+  delete[] gradient;
+  delete[] sdf;
+  return;
+}
+
+void CalculatePointCloudNearestObstacle(uint64_t *occupied_bits, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud, double min[3], int size[3], double voxel_size, int parallel)
+{
+  // Feature transform: index of the nearest obstacle voxel of every voxel
+  int voxels = size[0]*size[1]*size[2];
+  uint8_t* labels = new uint8_t[voxels];
+  for (int i=0; i<voxels; i++) labels[i] = !edt::get_packed(occupied_bits, size[0], i);
+  int64_t* features = edt::binary_feature_transform<uint8_t>(labels, size[0], size[1], size[2], 1.0, 1.0, 1.0, parallel);
+
+  // One nearest obstacle per edt_cloud point, NaN if there is none
+  nearest_cloud->points.clear();
+  double max[3];
+  for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
+  for (int i=0; i<edt_cloud->points.size(); i++) {
+    pcl::PointXYZ nearest;
+    nearest.x = nearest.y = nearest.z = std::numeric_limits<float>::quiet_NaN();
+    double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
+    if (CheckPointInBounds(query, min, max)) {
+      int64_t feature = features[xyz_index3(query, min, size, voxel_size)];
+      if (feature >= 0) {
+        double point[3];
+        index3_xyz((int)feature, point, min, size, voxel_size);
+        nearest.x = point[0]; nearest.y = point[1]; nearest.z = point[2];
+      }
+    }
+    nearest_cloud->points.push_back(nearest);
+  }
+
+  delete[] labels;
+  delete[] features;
+  return;
+}
+
+void MarkObstacleClass(uint8_t *obstacle_classes, const pcl::PointXYZI& point, uint8_t obstacle_class, double min[3], int size[3], double voxel_size)
+{
+  if (obstacle_classes == NULL) return;
+  double query[3] = {point.x, point.y, point.z};
+  int id = xyz_index3(query, min, size, voxel_size);
+  if ((id >= 0) && (id < size[0]*size[1]*size[2])) obstacle_classes[id] = obstacle_class;
+}
+
+void CalculatePointCloudClassEDT(uint8_t *obstacle_classes, pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, std::vector<float>& class_distances, double min[3], int size[3], double voxel_size, float truncation_distance, int parallel)
+{
+  // Distance to each obstacle class on its own, every class in one EDT call
+  int voxels = size[0]*size[1]*size[2];
+  float* distances = edt::binary_class_edt<uint8_t>(obstacle_classes, size[0], size[1], size[2], 1.0, 1.0, 1.0, OBSTACLE_CLASSES, false, parallel);
+
+  // OBSTACLE_CLASSES values per edt_cloud point, NaN if it is outside the grid
+  class_distances.assign(OBSTACLE_CLASSES*edt_cloud->points.size(), std::numeric_limits<float>::quiet_NaN());
+  double max[3];
+  for (int i=0; i<3; i++) max[i] = min[i] + (size[i]-1)*voxel_size;
+  for (int i=0; i<edt_cloud->points.size(); i++) {
+    double query[3] = {(double)edt_cloud->points[i].x, (double)edt_cloud->points[i].y, (double)edt_cloud->points[i].z};
+    if (CheckPointInBounds(query, min, max)) {
+      int idx = xyz_index3(query, min, size, voxel_size);
+      for (int c=0; c<OBSTACLE_CLASSES; c++) {
+        class_distances[OBSTACLE_CLASSES*i + c] = std::min(distances[c*voxels + idx]*(float)voxel_size, truncation_distance);
+      }
+    }
+  }
+
+  delete[] distances;
   return;
 }
 
@@ -145,22 +337,33 @@ void InflateObstacles(pcl::PointCloud<pcl::PointXYZI>::Ptr edt_cloud, float infl
   return;
 }
 
+// Both maps are decoded on their buffer's thread, so the spin thread stays free
+// for odometry
 void CallbackOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 {
   ROS_INFO("Subscribing to Octomap...");
   if (msg->data.size() == 0) return;
-  delete map_octree;
-  map_octree = (octomap::OcTree*)octomap_msgs::fullMsgToMap(*msg);
-  map_updated = true;
+  map_buffer.submit(msg);
 }
 
 void CallbackRoughOctomap(const octomap_msgs::Octomap::ConstPtr msg)
 {
   ROS_INFO("Subscribing to Rough Octomap...");
   if (msg->data.size() == 0) return;
-  delete rough_octree;
-  rough_octree = (octomap::RoughOcTree*)octomap_msgs::fullMsgToMap(*msg);
-  map_updated = true;
+  rough_buffer.submit(msg);
+}
+
+// Picks up the newest maps decoded in the background, if there are any
+void AcquireOctomaps()
+{
+  if (map_buffer.acquire()) {
+    map_octree = map_buffer.front();
+    map_updated = true;
+  }
+  if (rough_buffer.acquire()) {
+    rough_octree = rough_buffer.front();
+    map_updated = true;
+  }
 }
 
 void CallbackRoughCloud(const sensor_msgs::PointCloud2::ConstPtr msg)
@@ -216,7 +419,56 @@ void NodeManager::GetGroundMsg()
 void NodeManager::GetEdtMsg()
 {
   sensor_msgs::PointCloud2 msg;
-  pcl::toROSMsg(*edt_cloud, msg);
+  bool with_nearest = publish_nearest_obstacle && (nearest_cloud->points.size() == edt_cloud->points.size());
+  bool with_classes = publish_obstacle_classes && (class_distances.size() == OBSTACLE_CLASSES*edt_cloud->points.size());
+  if (with_nearest || with_classes) {
+    // x, y, z, intensity plus the position of the nearest obstacle and/or
+    // the distance to each obstacle class, all FLOAT32
+    std::vector<std::string> fields = {"x", "y", "z", "intensity"};
+    if (with_nearest) {
+      fields.push_back("obstacle_x");
+      fields.push_back("obstacle_y");
+      fields.push_back("obstacle_z");
+    }
+    if (with_classes) {
+      for (int c=0; c<OBSTACLE_CLASSES; c++) fields.push_back(OBSTACLE_CLASS_FIELDS[c]);
+    }
+    for (int f=0; f<fields.size(); f++) {
+      sensor_msgs::PointField field;
+      field.name = fields[f];
+      field.offset = f*sizeof(float);
+      field.datatype = sensor_msgs::PointField::FLOAT32;
+      field.count = 1;
+      msg.fields.push_back(field);
+    }
+    msg.height = 1;
+    msg.width = edt_cloud->points.size();
+    msg.is_bigendian = false;
+    msg.point_step = fields.size()*sizeof(float);
+    msg.row_step = msg.point_step*msg.width;
+    msg.is_dense = false;
+    msg.data.resize(msg.row_step);
+    std::vector<float> point(fields.size());
+    for (int i=0; i<edt_cloud->points.size(); i++) {
+      int f = 0;
+      point[f++] = edt_cloud->points[i].x;
+      point[f++] = edt_cloud->points[i].y;
+      point[f++] = edt_cloud->points[i].z;
+      point[f++] = edt_cloud->points[i].intensity;
+      if (with_nearest) {
+        point[f++] = nearest_cloud->points[i].x;
+        point[f++] = nearest_cloud->points[i].y;
+        point[f++] = nearest_cloud->points[i].z;
+      }
+      if (with_classes) {
+        for (int c=0; c<OBSTACLE_CLASSES; c++) point[f++] = class_distances[OBSTACLE_CLASSES*i + c];
+      }
+      memcpy(&msg.data[i*msg.point_step], point.data(), msg.point_step);
+    }
+  }
+  else {
+    pcl::toROSMsg(*edt_cloud, msg);
+  }
   msg.header.seq = 1;
   msg.header.stamp = ros::Time();
   msg.header.frame_id = fixed_frame_id;
@@ -290,9 +542,10 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     bbx_size[i] = (int)std::round((bbx_max[i] - bbx_min[i])/voxel_size) + 1;
   }
   int bbx_mat_length = bbx_size[0]*bbx_size[1]*bbx_size[2];
-  // bool occupied_mat[bbx_mat_length];
-  bool* occupied_mat = new bool[bbx_mat_length]; // Allows for more memory allocation
-  for (int i=0; i<bbx_mat_length; i++) occupied_mat[i] = true;
+  // Bit-packed occupancy, one bit per voxel (set = occupied), all unoccupied to start
+  uint64_t* occupied_bits = new uint64_t[edt::packed_words(bbx_size[0], bbx_size[1], bbx_size[2])](); // Allows for more memory allocation
+  // Obstacle class of every voxel (ObstacleClass, 0 = free), only for the per-class channels
+  uint8_t* obstacle_classes = publish_obstacle_classes ? new uint8_t[bbx_mat_length]() : NULL;
 
   ROS_INFO("Removing the voxels within the bounding box from the ground_cloud of length %d", (int)ground_cloud->points.size());
 
@@ -305,18 +558,19 @@ void NodeManager::FindGroundVoxels(std::string map_size)
   pcl::PointCloud<pcl::PointXYZI>::Ptr ground_cloud_free(new pcl::PointCloud<pcl::PointXYZI>); // free voxels with unseen below.
   pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud(new pcl::PointCloud<pcl::PointXYZ>);
 
-  // Expand octomap 
-  map_octree->expand();
-
-  for(octomap::OcTree::leaf_bbx_iterator
-  it = map_octree->begin_leafs_bbx(bbx_min_octomap, bbx_max_octomap);
-  it != map_octree->end_leafs_bbx(); ++it)
+  // Pruned leaves are walked as boxes, clipped to the bounding box, instead of expanding the tree
+  KeyBox bbx_keys = BoundingKeyBox(*map_octree, bbx_min_octomap, bbx_max_octomap);
+  ForEachLeafBox(*map_octree, bbx_min_octomap, bbx_max_octomap, [&](const KeyBox& box, const octomap::OcTreeNode& leaf)
   {
-    double query[3];
-    query[0] = it.getX(); query[1] = it.getY(); query[2] = it.getZ();
-    if (it->getOccupancy() <= 0.4) { // free
+    if (leaf.getOccupancy() > 0.4) return;
+    // free, only its bottom voxels can have an unseen cell below
+    KeyBox bottom = box;
+    bottom.hi[2] = bottom.lo[2] + 1;
+    ForEachBoxVoxel(ClipKeyBox(bottom, bbx_keys), [&](const octomap::OcTreeKey& key) {
+      octomap::point3d point = map_octree->keyToCoord(key);
+      double query[3] = {point.x(), point.y(), point.z()};
       // Check if the cell below it is unseen
-     octomap::OcTreeNode* node = map_octree->search(query[0], query[1], query[2] - voxel_size);
+      octomap::OcTreeNode* node = map_octree->search(query[0], query[1], query[2] - voxel_size);
       if (node) {
         if ((node->getOccupancy() <= 0.55) && (node->getOccupancy() >= 0.45)) {
           pcl::PointXYZI query_point;
@@ -332,11 +586,11 @@ void NodeManager::FindGroundVoxels(std::string map_size)
         ground_cloud_prefilter->points.push_back(query_point);
         ground_cloud_free->points.push_back(query_point);
       }
-    }
-  }
+    });
+  });
   // ***** //
 
-  // Iterate through roughness pointcloud and add all points below max_roughness to the initial ground_cloud and all others to the occupied_mat
+  // Iterate through roughness pointcloud and add all points below max_roughness to the initial ground_cloud and all others to the occupied_bits
   pcl::PointCloud<pcl::PointXYZI>::Ptr rough_cloud_bbx (new pcl::PointCloud<pcl::PointXYZI>);
   pcl::CropBox<pcl::PointXYZI> box_filter_rough;
   box_filter_rough.setMin(bbx_min);
@@ -353,7 +607,8 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     } else if ((rough_voxel.intensity >= max_roughness) && (rough_voxel.intensity <= 1.1)) {
       double query[3] = {rough_voxel.x, rough_voxel.y, rough_voxel.z};
       int id = xyz_index3(query, bbx_min_array, bbx_size, voxel_size);
-      occupied_mat[id] = false;
+      edt::set_packed(occupied_bits, bbx_size[0], id, true);
+      MarkObstacleClass(obstacle_classes, rough_voxel, OBSTACLE_ROUGH, bbx_min_array, bbx_size, voxel_size);
       pcl::PointXYZ query_point;
       query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2];
       obstacle_cloud->points.push_back(query_point);
@@ -390,6 +645,9 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     } else {
       if (query.intensity <= -0.5) {
         negative_obstacle_cloud->points.push_back(query);
+        MarkObstacleClass(obstacle_classes, query, OBSTACLE_NEGATIVE, bbx_min_array, bbx_size, voxel_size);
+      } else {
+        MarkObstacleClass(obstacle_classes, query, OBSTACLE_GEOMETRIC, bbx_min_array, bbx_size, voxel_size);
       }
     }
   }
@@ -454,6 +712,8 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     }
   } else {
     ROS_INFO("No new cloud entries, publishing previous cloud msg");
+    delete[] occupied_bits;
+    delete[] obstacle_classes;
     return;
   }
 
@@ -517,7 +777,18 @@ void NodeManager::FindGroundVoxels(std::string map_size)
 
   // EDT Calculation
   ROS_INFO("Calculating EDT.");
-  CalculatePointCloudEDT(occupied_mat, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance);
+  CalculatePointCloudEDT((map_size == "bbx") ? edt_bbx : edt_full, occupied_bits, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_z_window, edt_threads);
+  if (publish_sdf) {
+    CalculatePointCloudSDF(occupied_bits, edt_cloud_bbx_smaller, sdf_cloud, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
+    pcl::toROSMsg(*sdf_cloud, sdf_msg);
+    sdf_msg.header.seq = 1;
+    sdf_msg.header.stamp = ros::Time();
+    sdf_msg.header.frame_id = fixed_frame_id;
+  }
+  pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud_bbx (new pcl::PointCloud<pcl::PointXYZ>);
+  if (publish_nearest_obstacle) CalculatePointCloudNearestObstacle(occupied_bits, edt_cloud_bbx_smaller, nearest_cloud_bbx, bbx_min_array, bbx_size, voxel_size, edt_threads);
+  std::vector<float> class_distances_bbx;
+  if (publish_obstacle_classes) CalculatePointCloudClassEDT(obstacle_classes, edt_cloud_bbx_smaller, class_distances_bbx, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
   InflateObstacles(edt_cloud_bbx_smaller, inflate_distance);
   ROS_INFO("EDT calculated.");
 
@@ -535,6 +806,41 @@ void NodeManager::FindGroundVoxels(std::string map_size)
       edt_cloud_local->points.push_back(edt_cloud_bbx_smaller->points[i]);
     }
 
+    // Keep nearest_cloud and class_distances aligned with edt_cloud. The
+    // points kept from the previous cloud reuse their old values only if
+    // those still line up with it (the option may have just been turned
+    // on); otherwise the whole cloud is recomputed on the current grid.
+    std::vector<int> kept;
+    if (publish_nearest_obstacle || publish_obstacle_classes) box_filter3.filter(kept);
+    if (publish_nearest_obstacle) {
+      pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud_local (new pcl::PointCloud<pcl::PointXYZ>);
+      if (nearest_cloud->points.size() == edt_cloud->points.size()) {
+        for (int i=0; i<kept.size(); i++) {
+          nearest_cloud_local->points.push_back(nearest_cloud->points[kept[i]]);
+        }
+        for (int i=0; i<nearest_cloud_bbx->points.size(); i++) {
+          nearest_cloud_local->points.push_back(nearest_cloud_bbx->points[i]);
+        }
+      }
+      else {
+        CalculatePointCloudNearestObstacle(occupied_bits, edt_cloud_local, nearest_cloud_local, bbx_min_array, bbx_size, voxel_size, edt_threads);
+      }
+      nearest_cloud = nearest_cloud_local;
+    }
+    if (publish_obstacle_classes) {
+      std::vector<float> class_distances_local;
+      if (class_distances.size() == OBSTACLE_CLASSES*edt_cloud->points.size()) {
+        for (int i=0; i<kept.size(); i++) {
+          for (int c=0; c<OBSTACLE_CLASSES; c++) class_distances_local.push_back(class_distances[OBSTACLE_CLASSES*kept[i] + c]);
+        }
+        class_distances_local.insert(class_distances_local.end(), class_distances_bbx.begin(), class_distances_bbx.end());
+      }
+      else {
+        CalculatePointCloudClassEDT(obstacle_classes, edt_cloud_local, class_distances_local, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
+      }
+      class_distances.swap(class_distances_local);
+    }
+
     edt_cloud->points.clear();
     for (int i=0; i<edt_cloud_local->points.size(); i++) {
       edt_cloud->points.push_back(edt_cloud_local->points[i]);
@@ -545,12 +851,15 @@ void NodeManager::FindGroundVoxels(std::string map_size)
     for (int i=0; i<edt_cloud_bbx_smaller->points.size(); i++) {
       edt_cloud->points.push_back(edt_cloud_bbx_smaller->points[i]);
     }
+    nearest_cloud = nearest_cloud_bbx;
+    class_distances.swap(class_distances_bbx);
   }
   
 
   GetGroundMsg();
   GetEdtMsg();
-  delete[] occupied_mat;
+  delete[] occupied_bits;
+  delete[] obstacle_classes;
   ROS_INFO("Publishing edt");
   return;
 }
@@ -616,9 +925,10 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
     bbx_size[i] = (int)std::round((bbx_max[i] - bbx_min[i])/voxel_size) + 1;
   }
   int bbx_mat_length = bbx_size[0]*bbx_size[1]*bbx_size[2];
-  // bool occupied_mat[bbx_mat_length];
-  bool* occupied_mat = new bool[bbx_mat_length]; // Allows for more memory allocation
-  for (int i=0; i<bbx_mat_length; i++) occupied_mat[i] = true;
+  // Bit-packed occupancy, one bit per voxel (set = occupied), all unoccupied to start
+  uint64_t* occupied_bits = new uint64_t[edt::packed_words(bbx_size[0], bbx_size[1], bbx_size[2])](); // Allows for more memory allocation
+  // Obstacle class of every voxel (ObstacleClass, 0 = free), only for the per-class channels
+  uint8_t* obstacle_classes = publish_obstacle_classes ? new uint8_t[bbx_mat_length]() : NULL;
 
   ROS_INFO("Removing the voxels within the bounding box from the ground_cloud of length %d", (int)ground_cloud->points.size());
 
@@ -631,50 +941,68 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
   pcl::PointCloud<pcl::PointXYZI>::Ptr ground_cloud_free(new pcl::PointCloud<pcl::PointXYZI>); // free voxels with unseen below.
   pcl::PointCloud<pcl::PointXYZ>::Ptr obstacle_cloud(new pcl::PointCloud<pcl::PointXYZ>);
 
-  // Expand octomap 
-  rough_octree->expand();
-
-  for(octomap::RoughOcTree::leaf_bbx_iterator
-  it = rough_octree->begin_leafs_bbx(bbx_min_octomap, bbx_max_octomap);
-  it != rough_octree->end_leafs_bbx(); ++it)
+  // Pruned leaves are walked as boxes, clipped to the bounding box, instead of expanding the tree
+  KeyBox bbx_keys = BoundingKeyBox(*rough_octree, bbx_min_octomap, bbx_max_octomap);
+  // Key of the voxel at index 0 of the bounding box grid, see leaf_rasterizer.h
+  octomap::OcTreeKey bbx_origin_key = rough_octree->coordToKey(bbx_min_octomap);
+  ForEachLeafBox(*rough_octree, bbx_min_octomap, bbx_max_octomap, [&](const KeyBox& box, octomap::RoughOcTreeNode& leaf)
   {
-    double query[3];
-    query[0] = it.getX(); query[1] = it.getY(); query[2] = it.getZ();
-    if (it->getOccupancy() <= 0.4) { // free
-      // Check if the cell below it is unseen
-     octomap::OcTreeNode* node = rough_octree->search(query[0], query[1], query[2] - voxel_size);
-      if (node) {
-        if ((node->getOccupancy() <= 0.55) && (node->getOccupancy() >= 0.45)) {
+    if (leaf.getOccupancy() <= 0.4) { // free
+      // Only its bottom voxels can have an unseen cell below
+      KeyBox bottom = box;
+      bottom.hi[2] = bottom.lo[2] + 1;
+      ForEachBoxVoxel(ClipKeyBox(bottom, bbx_keys), [&](const octomap::OcTreeKey& key) {
+        octomap::point3d point = rough_octree->keyToCoord(key);
+        double query[3] = {point.x(), point.y(), point.z()};
+        // Check if the cell below it is unseen
+        octomap::OcTreeNode* node = rough_octree->search(query[0], query[1], query[2] - voxel_size);
+        if (node) {
+          if ((node->getOccupancy() <= 0.55) && (node->getOccupancy() >= 0.45)) {
+            pcl::PointXYZI query_point;
+            query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2];
+            query_point.intensity = (float)-1.0; // (.intensity == -1.0) --> free voxel
+            ground_cloud_prefilter->points.push_back(query_point);
+            ground_cloud_free->points.push_back(query_point);
+          }
+        } else {
           pcl::PointXYZI query_point;
           query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2];
           query_point.intensity = (float)-1.0; // (.intensity == -1.0) --> free voxel
           ground_cloud_prefilter->points.push_back(query_point);
           ground_cloud_free->points.push_back(query_point);
         }
-      } else {
-        pcl::PointXYZI query_point;
-        query_point.x = query[0]; query_point.y = query[1]; query_point.z = query[2];
-        query_point.intensity = (float)-1.0; // (.intensity == -1.0) --> free voxel
-        ground_cloud_prefilter->points.push_back(query_point);
-        ground_cloud_free->points.push_back(query_point);
-      }
+      });
     }
-    else if (it->getOccupancy() >= 0.6) { // occupied
-      if ((it->getRough() <= max_roughness) || (std::isnan(it->getRough()))) {
-        pcl::PointXYZI rough_voxel;
-        rough_voxel.x = query[0]; rough_voxel.y = query[1]; rough_voxel.z = query[2];
-        rough_voxel.intensity = it->getRough();
-        ground_cloud_traversable->points.push_back(rough_voxel);
-        ground_cloud_prefilter->points.push_back(rough_voxel);
+    else if (leaf.getOccupancy() >= 0.6) { // occupied
+      KeyBox voxels = ClipKeyBox(box, bbx_keys);
+      if ((leaf.getRough() <= max_roughness) || (std::isnan(leaf.getRough()))) {
+        ForEachBoxVoxel(voxels, [&](const octomap::OcTreeKey& key) {
+          octomap::point3d point = rough_octree->keyToCoord(key);
+          pcl::PointXYZI rough_voxel;
+          rough_voxel.x = point.x(); rough_voxel.y = point.y(); rough_voxel.z = point.z();
+          rough_voxel.intensity = leaf.getRough();
+          ground_cloud_traversable->points.push_back(rough_voxel);
+          ground_cloud_prefilter->points.push_back(rough_voxel);
+        });
       } else {
-        int id = xyz_index3(query, bbx_min_array, bbx_size, voxel_size);
-        occupied_mat[id] = false;
-        pcl::PointXYZ rough_voxel;
-        rough_voxel.x = query[0]; rough_voxel.y = query[1]; rough_voxel.z = query[2];
-        obstacle_cloud->points.push_back(rough_voxel);
+        // The whole leaf is one obstacle
+        KeyBox cells = GridBox(voxels, bbx_origin_key, bbx_size);
+        if (!cells.empty()) {
+          edt::set_packed_box(occupied_bits, bbx_size[0], bbx_size[1],
+            cells.lo[0], cells.lo[1], cells.lo[2], cells.hi[0], cells.hi[1], cells.hi[2], true);
+        }
+        ForEachBoxVoxel(voxels, [&](const octomap::OcTreeKey& key) {
+          octomap::point3d point = rough_octree->keyToCoord(key);
+          pcl::PointXYZI obstacle_voxel;
+          obstacle_voxel.x = point.x(); obstacle_voxel.y = point.y(); obstacle_voxel.z = point.z();
+          MarkObstacleClass(obstacle_classes, obstacle_voxel, OBSTACLE_ROUGH, bbx_min_array, bbx_size, voxel_size);
+          pcl::PointXYZ rough_voxel;
+          rough_voxel.x = point.x(); rough_voxel.y = point.y(); rough_voxel.z = point.z();
+          obstacle_cloud->points.push_back(rough_voxel);
+        });
       }
     }
-  }
+  });
 
   // Publish the initial ground cloud and the negative ground only cloud
   debug_publishers[0].publish(ConvertCloudToMsg(ground_cloud_free, fixed_frame_id));
@@ -706,6 +1034,9 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
     } else {
       if (query.intensity <= -0.5) {
         negative_obstacle_cloud->points.push_back(query);
+        MarkObstacleClass(obstacle_classes, query, OBSTACLE_NEGATIVE, bbx_min_array, bbx_size, voxel_size);
+      } else {
+        MarkObstacleClass(obstacle_classes, query, OBSTACLE_GEOMETRIC, bbx_min_array, bbx_size, voxel_size);
       }
     }
   }
@@ -770,6 +1101,8 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
     }
   } else {
     ROS_INFO("No new cloud entries, publishing previous cloud msg");
+    delete[] occupied_bits;
+    delete[] obstacle_classes;
     return;
   }
 
@@ -833,7 +1166,18 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
 
   // EDT Calculation
   ROS_INFO("Calculating EDT.");
-  CalculatePointCloudEDT(occupied_mat, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance);
+  CalculatePointCloudEDT((map_size == "bbx") ? edt_bbx : edt_full, occupied_bits, edt_cloud_bbx_smaller, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_z_window, edt_threads);
+  if (publish_sdf) {
+    CalculatePointCloudSDF(occupied_bits, edt_cloud_bbx_smaller, sdf_cloud, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
+    pcl::toROSMsg(*sdf_cloud, sdf_msg);
+    sdf_msg.header.seq = 1;
+    sdf_msg.header.stamp = ros::Time();
+    sdf_msg.header.frame_id = fixed_frame_id;
+  }
+  pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud_bbx (new pcl::PointCloud<pcl::PointXYZ>);
+  if (publish_nearest_obstacle) CalculatePointCloudNearestObstacle(occupied_bits, edt_cloud_bbx_smaller, nearest_cloud_bbx, bbx_min_array, bbx_size, voxel_size, edt_threads);
+  std::vector<float> class_distances_bbx;
+  if (publish_obstacle_classes) CalculatePointCloudClassEDT(obstacle_classes, edt_cloud_bbx_smaller, class_distances_bbx, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
   InflateObstacles(edt_cloud_bbx_smaller, inflate_distance);
   ROS_INFO("EDT calculated.");
 
@@ -851,6 +1195,41 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
       edt_cloud_local->points.push_back(edt_cloud_bbx_smaller->points[i]);
     }
 
+    // Keep nearest_cloud and class_distances aligned with edt_cloud. The
+    // points kept from the previous cloud reuse their old values only if
+    // those still line up with it (the option may have just been turned
+    // on); otherwise the whole cloud is recomputed on the current grid.
+    std::vector<int> kept;
+    if (publish_nearest_obstacle || publish_obstacle_classes) box_filter3.filter(kept);
+    if (publish_nearest_obstacle) {
+      pcl::PointCloud<pcl::PointXYZ>::Ptr nearest_cloud_local (new pcl::PointCloud<pcl::PointXYZ>);
+      if (nearest_cloud->points.size() == edt_cloud->points.size()) {
+        for (int i=0; i<kept.size(); i++) {
+          nearest_cloud_local->points.push_back(nearest_cloud->points[kept[i]]);
+        }
+        for (int i=0; i<nearest_cloud_bbx->points.size(); i++) {
+          nearest_cloud_local->points.push_back(nearest_cloud_bbx->points[i]);
+        }
+      }
+      else {
+        CalculatePointCloudNearestObstacle(occupied_bits, edt_cloud_local, nearest_cloud_local, bbx_min_array, bbx_size, voxel_size, edt_threads);
+      }
+      nearest_cloud = nearest_cloud_local;
+    }
+    if (publish_obstacle_classes) {
+      std::vector<float> class_distances_local;
+      if (class_distances.size() == OBSTACLE_CLASSES*edt_cloud->points.size()) {
+        for (int i=0; i<kept.size(); i++) {
+          for (int c=0; c<OBSTACLE_CLASSES; c++) class_distances_local.push_back(class_distances[OBSTACLE_CLASSES*kept[i] + c]);
+        }
+        class_distances_local.insert(class_distances_local.end(), class_distances_bbx.begin(), class_distances_bbx.end());
+      }
+      else {
+        CalculatePointCloudClassEDT(obstacle_classes, edt_cloud_local, class_distances_local, bbx_min_array, bbx_size, voxel_size, truncation_distance, edt_threads);
+      }
+      class_distances.swap(class_distances_local);
+    }
+
     edt_cloud->points.clear();
     for (int i=0; i<edt_cloud_local->points.size(); i++) {
       edt_cloud->points.push_back(edt_cloud_local->points[i]);
@@ -861,12 +1240,15 @@ void NodeManager::FindGroundVoxels_RoughOctomap(std::string map_size)
     for (int i=0; i<edt_cloud_bbx_smaller->points.size(); i++) {
       edt_cloud->points.push_back(edt_cloud_bbx_smaller->points[i]);
     }
+    nearest_cloud = nearest_cloud_bbx;
+    class_distances.swap(class_distances_bbx);
   }
   
 
   GetGroundMsg();
   GetEdtMsg();
-  delete[] occupied_mat;
+  delete[] occupied_bits;
+  delete[] obstacle_classes;
   ROS_INFO("Publishing edt");
   return;
 }
@@ -887,6 +1269,8 @@ int main(int argc, char **argv)
   ros::Subscriber sub_rough_octomap = n.subscribe("rough_octomap", 1, CallbackRoughOctomap);
   ros::Publisher pub1 = n.advertise<sensor_msgs::PointCloud2>("ground", 5);
   ros::Publisher pub2 = n.advertise<sensor_msgs::PointCloud2>("edt", 5);
+  // Signed distance (intensity, meters) and its gradient (normal_x/y/z)
+  ros::Publisher pub_sdf = n.advertise<sensor_msgs::PointCloud2>("sdf", 5);
   ros::Publisher pub_prefilter_negative_ground = n.advertise<sensor_msgs::PointCloud2>("debug/ground_prefilter_negative", 5);
   ros::Publisher pub_prefilter_ground = n.advertise<sensor_msgs::PointCloud2>("debug/ground_prefilter", 5);
   ros::Publisher pub_traversable_ground = n.advertise<sensor_msgs::PointCloud2>("debug/ground_traversable", 5);
@@ -895,6 +1279,8 @@ int main(int argc, char **argv)
   // ros::Publisher pub_normal_cluster_ground = n.advertise<sensor_msgs::PointCloud2>("debug/ground_normal_cluster", 5);
   ros::Publisher pub_negative_obstacle = n.advertise<sensor_msgs::PointCloud2>("debug/negative_obstacle", 5);
   ros::Publisher pub_obstacle = n.advertise<sensor_msgs::PointCloud2>("debug/obstacles", 5);
+  // EDT thread pool statistics, see edt_diagnostics.h
+  ros::Publisher diagnostics_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1);
 
   node_manager.debug_publishers.push_back(pub_prefilter_negative_ground);
   node_manager.debug_publishers.push_back(pub_prefilter_ground);
@@ -915,6 +1301,15 @@ int main(int argc, char **argv)
   n.param("traversability_to_edt/sensor_range", node_manager.robot.sensor_range, 5.0);
   n.param("traversability_to_edt/use_tf", node_manager.use_tf, false);
   n.param("traversability_to_edt/truncation_distance", node_manager.truncation_distance, (float)4.0);
+  n.param("traversability_to_edt/edt_z_window", node_manager.edt_z_window, -1);
+  n.param("traversability_to_edt/edt_threads", node_manager.edt_threads, 0);
+  edt::set_pass_logger(LogEDTPass);
+  ROS_INFO("EDT thread budget: %d (0 = all cores)", node_manager.edt_threads);
+  float diagnostics_period;
+  n.param("traversability_to_edt/diagnostics_period", diagnostics_period, (float)5.0);
+  n.param("traversability_to_edt/publish_sdf", node_manager.publish_sdf, false);
+  n.param("traversability_to_edt/publish_nearest_obstacle", node_manager.publish_nearest_obstacle, false);
+  n.param("traversability_to_edt/publish_obstacle_classes", node_manager.publish_obstacle_classes, false);
   n.param("traversability_to_edt/inflate_distance", node_manager.inflate_distance, (float)0.0);
   n.param("traversability_to_edt/filter_holes", node_manager.filter_holes, false);
   n.param("traversability_to_edt/max_roughness", node_manager.max_roughness, (float)0.5);
@@ -929,10 +1324,12 @@ int main(int argc, char **argv)
   ROS_INFO("Finished reading params.");
   // Main Loop
   int ticks = -1;
+  ros::Time last_diagnostics = ros::Time::now();
   while (ros::ok())
   {
     r.sleep();
     ros::spinOnce();
+    AcquireOctomaps();
     if (map_updated) ticks++;
     if ((ticks % full_map_ticks) == 0) {
       // node_manager.FindGroundVoxels("full");
@@ -945,5 +1342,11 @@ int main(int argc, char **argv)
     // ROS_INFO("ground cloud currently has %d points", (int)node_manager.ground_cloud->points.size());
     if (node_manager.ground_cloud->points.size() > 0) pub1.publish(node_manager.ground_msg);
     if (node_manager.edt_cloud->points.size() > 0) pub2.publish(node_manager.edt_msg);
+    if (node_manager.publish_sdf && (node_manager.sdf_msg.data.size() > 0)) pub_sdf.publish(node_manager.sdf_msg);
+    const double since_diagnostics = (ros::Time::now() - last_diagnostics).toSec();
+    if ((diagnostics_period > 0.0) && (since_diagnostics >= diagnostics_period)) {
+      diagnostics_pub.publish(GetEDTPoolDiagnostics("traversability_to_edt", since_diagnostics));
+      last_diagnostics = ros::Time::now();
+    }
   }
 }
\ No newline at end of file